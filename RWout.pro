@@ -26,29 +26,39 @@ SOURCES += \
     fg_category_delegate.cpp \
     fileuploader.cpp \
     gentextdocument.cpp \
+    imageasset.cpp \
     main.cpp \
     mainwindow.cpp \
     mappinsdialog.cpp \
     outputfgmod.cpp \
+    outputfile.cpp \
     outputmarkdown.cpp \
+    portfolio.cpp \
     xmlelement.cpp \
     outputhtml.cpp \
     linefile.cpp \
-    outhtml4subset.cpp
+    outhtml4subset.cpp \
+    topicsorter.cpp
 
 HEADERS += \
     fg_category_delegate.h \
     fileuploader.h \
     gentextdocument.h \
+    imageasset.h \
     mainwindow.h \
     mappinsdialog.h \
     outputfgmod.h \
+    outputfile.h \
     outputmarkdown.h \
+    portfolio.h \
+    rendercache.h \
     xmlelement.h \
     outputhtml.h \
     linefile.h \
     outhtml4subset.h \
-    linkage.h
+    linkage.h \
+    symboltable.h \
+    topicsorter.h
 
 FORMS += \
         mainwindow.ui \
@@ -1,6 +1,7 @@
 #ifndef GENTEXTDOCUMENT_H
 #define GENTEXTDOCUMENT_H
 
+#include <QPdfWriter>
 #include <QString>
 #include <QTextDocument>
 #include "xmlelement.h"
@@ -10,4 +11,10 @@ void genTextDocument(QTextDocument &doc,
                     int max_image_width,
                     bool use_reveal_mask);
 
-#endif // OUTHTML4SUBSET_H
+void genPdf(QPdfWriter &pdf,
+            const QSizeF &page_size,
+            const XmlElement *root,
+            int max_image_width,
+            bool use_reveal_mask);
+
+#endif // GENTEXTDOCUMENT_H
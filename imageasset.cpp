@@ -0,0 +1,267 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "imageasset.h"
+
+#include <QBuffer>
+#include <QDebug>
+#include <QImage>
+#include <QImageReader>
+#include <QMap>
+#include <QMutex>
+#include <QPainter>
+#include <list>
+#include <tuple>
+
+#include "xmlelement.h"
+
+//#define PRINT_IMAGE_CACHE
+
+struct ImageKey
+{
+    const char *data;
+    int size;
+    const XmlElement *mask;
+    bool apply_mask;
+    int max_width;
+    bool operator<(const ImageKey &other) const
+    {
+        return std::tie(data, size, mask, apply_mask, max_width) <
+                std::tie(other.data, other.size, other.mask, other.apply_mask, other.max_width);
+    }
+};
+
+typedef std::list<ImageKey> ImageUsage;
+
+struct ImageEntry
+{
+    QByteArray source;      // keeps the original data (and so the key's pointer) valid
+    ImageAsset asset;
+    ImageUsage::iterator usage;     // position in image_cache_usage
+};
+
+static QMap<ImageKey,ImageEntry> image_cache;
+static ImageUsage image_cache_usage;    // the keys of image_cache, least recently used first
+static QMutex image_cache_mutex;
+static qint64 image_cache_bytes = 0;    // size of the converted images held in the cache
+// The least recently used images are forgotten once the converted images use more than this.
+static const qint64 IMAGE_CACHE_BUDGET = 256 * 1024 * 1024;
+
+
+/**
+ * @brief decode_image
+ * Works out what needs to be done to the image, and (only if something needs to be done) decodes it,
+ * applies the mask and reduces its width.
+ * Only QImage is used (not QPixmap), so this can be called from any thread.
+ * @param mask_data the contents of the reveal mask (empty if there is no mask)
+ * @param result set to the format, size and divisor of the prepared image (but not its data)
+ * @return the prepared image, or a null image if the original data can be used as it is
+ */
+static QImage decode_image(const QByteArray &orig_data, const QString &filename, const QByteArray &mask_data,
+                           bool apply_mask, int max_width, bool force_decode, ImageAsset &result)
+{
+    result.format = filename.split(".").last();
+
+    // Read the size from the header, in case the image doesn't need decoding
+    QBuffer buffer;
+    buffer.setData(orig_data);
+    QImageReader reader(&buffer, qPrintable(result.format));
+    result.size = reader.size();
+
+    // See if possible image conversion is required
+    const bool bad_format = (result.format == "bmp" || result.format == "tif" || result.format == "tiff");
+    const bool use_mask   = !mask_data.isEmpty() && apply_mask;
+    const bool too_wide   = max_width > 0 && (!result.size.isValid() || result.size.width() > max_width);
+    if (!bad_format && !use_mask && !too_wide && !force_decode) return QImage();
+
+    QImage image = QImage::fromData(orig_data, qPrintable(result.format));
+    if (bad_format) result.format = "png";
+
+    // Apply mask, if supplied
+    if (use_mask)
+    {
+        // If the mask is empty, then don't use it
+        // (if the image is JPG, the mask isn't necessarily JPG
+        // Reduce to one bit per pixel, as QBitmap would (the dark parts of the mask are shaded)
+        const QImage mask = QImage::fromData(mask_data).convertToFormat(QImage::Format_Mono);
+
+        // Ensure we have a 32-bit image to convert
+        image = image.convertToFormat(QImage::Format_RGB32);
+
+        if (image.size() != mask.size())
+        {
+            qWarning() << "Image size differences for" << filename << ": image =" << image.size() << ", mask =" << mask.size();
+        }
+        // Create a shading overlay, which is only opaque where the mask is set
+        QImage overlay(image.size(), QImage::Format_ARGB32_Premultiplied);
+        overlay.fill(Qt::transparent);
+        const QRgb shade = qPremultiply(qRgba(0, 0, 0, 200));
+        const int mask_width  = qMin(image.width(),  mask.width());
+        const int mask_height = qMin(image.height(), mask.height());
+        for (int y = 0; y < mask_height; y++)
+        {
+            QRgb *line = reinterpret_cast<QRgb*>(overlay.scanLine(y));
+            for (int x = 0; x < mask_width; x++)
+                if (qGray(mask.pixel(x, y)) < 128) line[x] = shade;
+        }
+
+        // Apply the mask to the original picture
+        QPainter painter(&image);
+        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+        painter.drawImage(0, 0, overlay);
+    }
+
+    // Reduce width in a binary fashion, so maximum detail is kept.
+    if (max_width > 0)
+    {
+        int new_width = image.width();
+        while (new_width > max_width)
+        {
+            result.divisor = result.divisor << 1;
+            new_width = new_width >> 1;
+        }
+        if (result.divisor > 1)
+        {
+            image = image.scaledToWidth(new_width, Qt::SmoothTransformation);
+        }
+    }
+
+    result.size = image.size();
+    if (!bad_format && !use_mask && result.divisor == 1 && !force_decode)
+    {
+        // Nothing changed after all
+        return QImage();
+    }
+    return image;
+}
+
+
+/**
+ * @brief encodeImage
+ * Puts the image into asset.data, using asset.format
+ * (the image is only compressed once, however it was modified).
+ */
+void encodeImage(const QImage &image, ImageAsset &asset)
+{
+    QBuffer output;
+    output.open(QIODevice::WriteOnly);
+    image.save(&output, qPrintable(asset.format));
+    output.close();
+    asset.data = output.data();
+    asset.size = image.size();
+    asset.converted = true;
+}
+
+
+static ImageAsset process_image(const QByteArray &orig_data, const QString &filename, const XmlElement *mask_elem,
+                                bool apply_mask, int max_width)
+{
+    ImageAsset result;
+    const QImage image = decode_image(orig_data, filename, mask_elem ? mask_elem->byteData() : QByteArray(),
+                                      apply_mask, max_width, /*force*/ false, result);
+    if (image.isNull())
+    {
+        result.data = orig_data;
+        return result;
+    }
+    //format = "png";   // not always better (especially if was JPG)
+    encodeImage(image, result);
+    return result;
+}
+
+
+/**
+ * @brief prepareImage
+ * Returns the image, ready for putting into the output.
+ * The result is remembered, so the conversion is only done once per image
+ * no matter how many times (or by how many writers) it is requested
+ * (unless the cache has grown beyond its budget since the image was last used).
+ * @param orig_data the contents of the asset
+ * @param filename the name of the asset (used to determine its format)
+ * @param mask_elem the reveal mask (optional)
+ * @param apply_mask true if the mask should be applied to the image
+ * @param max_width if > 0, the image is halved in size until it is no wider than this
+ * @return
+ */
+ImageAsset prepareImage(const QByteArray &orig_data, const QString &filename, const XmlElement *mask_elem,
+                        bool apply_mask, int max_width)
+{
+    const ImageKey key{orig_data.constData(), orig_data.size(), mask_elem, apply_mask && mask_elem, max_width};
+    {
+        QMutexLocker lock(&image_cache_mutex);
+        auto it = image_cache.find(key);
+        if (it != image_cache.end())
+        {
+#ifdef PRINT_IMAGE_CACHE
+            qDebug() << "prepareImage: reusing" << filename;
+#endif
+            image_cache_usage.splice(image_cache_usage.end(), image_cache_usage, it->usage);
+            return it->asset;
+        }
+    }
+
+    const ImageAsset asset = process_image(orig_data, filename, mask_elem, apply_mask, max_width);
+
+    QMutexLocker lock(&image_cache_mutex);
+    if (image_cache.contains(key)) return asset;    // prepared by another thread at the same time
+    image_cache.insert(key, ImageEntry{orig_data, asset, image_cache_usage.insert(image_cache_usage.end(), key)});
+    // Unconverted images share the data of the tree, so only converted images use more memory.
+    if (asset.converted) image_cache_bytes += asset.data.size();
+    while (image_cache_bytes > IMAGE_CACHE_BUDGET && image_cache.size() > 1)
+    {
+        auto oldest = image_cache.find(image_cache_usage.front());
+#ifdef PRINT_IMAGE_CACHE
+        qDebug() << "prepareImage: forgetting an image of" << oldest->asset.data.size() << "bytes";
+#endif
+        if (oldest->asset.converted) image_cache_bytes -= oldest->asset.data.size();
+        image_cache.erase(oldest);
+        image_cache_usage.pop_front();
+    }
+    return asset;
+}
+
+
+/**
+ * @brief prepareImagePixels
+ * As prepareImage, but returns the decoded image, for writers which draw on the image
+ * or put the decoded image straight into their output.
+ * The result is not cached. The mask is passed as its data, so that no XmlElement is read
+ * (and so this can be called from worker threads).
+ * @param mask_data the contents of the reveal mask (empty if there is no mask)
+ * @param asset set to the format, size and divisor of the image (asset.data is left empty)
+ * @return
+ */
+QImage prepareImagePixels(const QByteArray &orig_data, const QString &filename, const QByteArray &mask_data,
+                          bool apply_mask, int max_width, ImageAsset &asset)
+{
+    asset = ImageAsset();
+    return decode_image(orig_data, filename, mask_data, apply_mask, max_width, /*force*/ true, asset);
+}
+
+
+/**
+ * @brief clearImageAssets
+ * Forget all the prepared images (for use when a different file is loaded).
+ */
+void clearImageAssets()
+{
+    QMutexLocker lock(&image_cache_mutex);
+    image_cache.clear();
+    image_cache_usage.clear();
+    image_cache_bytes = 0;
+}
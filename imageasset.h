@@ -0,0 +1,52 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGEASSET_H
+#define IMAGEASSET_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+class XmlElement;
+
+/**
+ * @brief The ImageAsset struct
+ * An image that has been prepared for output: converted from a format that browsers can't display,
+ * with the reveal mask applied and reduced in size. All of the output formats need the same
+ * processing, so the result is shared by every writer that asks for the same image.
+ * (Only the images are shared: each writer still walks the XmlElement tree itself.)
+ */
+struct ImageAsset
+{
+    QByteArray data;        // the encoded image (the original data if no conversion was required)
+    QString    format;      // file extension for the encoded image
+    QSize      size;        // size of the encoded image
+    int        divisor{1};  // how much the original image was reduced (pin coordinates need dividing by this)
+    bool       converted{false};
+};
+
+ImageAsset prepareImage(const QByteArray &orig_data, const QString &filename, const XmlElement *mask_elem,
+                        bool apply_mask, int max_width);
+QImage prepareImagePixels(const QByteArray &orig_data, const QString &filename, const QByteArray &mask_data,
+                          bool apply_mask, int max_width, ImageAsset &asset);
+void encodeImage(const QImage &image, ImageAsset &asset);
+void clearImageAssets();
+
+#endif // IMAGEASSET_H
@@ -1,35 +1,215 @@
 #ifndef LINKAGE_H
 #define LINKAGE_H
 
-#include <QMap>
+#include <QHash>
+#include <QString>
+#include <QVector>
+#include <algorithm>
 
+/**
+ * @brief The LinkageList class
+ * The names of the topics which are linked from one topic.
+ *
+ * The names are compiled into an Aho-Corasick automaton, so that every occurrence
+ * of any of the names within a piece of text is found in a single pass over that text.
+ * Matching is case-insensitive, and only whole words are matched.
+ */
 class LinkageList
 {
+public:
+    struct Match
+    {
+        int start;
+        int length;
+        QString target_id;
+        int target_symbol;      // XmlElement::SymbolId of target_id (-1 if not supplied)
+    };
+    typedef QVector<Match> Matches;
+
 private:
-    QMap<QString, QString> map;
-    int maxlen{0};
+    struct State
+    {
+        int parent{0};
+        ushort ch{0};
+        int depth{0};
+        int fail{0};
+        int output{-1};     // index of the name which ends at this state
+        int dict{-1};       // next state along the fail chain which has an output
+    };
+    QVector<State> states{State()};
+    QHash<quint64,int> transitions;     // (state << 16 | folded character) -> state
+    QVector<QString> ids;               // target_id of each name
+    QVector<int> symbols;               // symbol of each target_id
+    QVector<int> lengths;               // length of each name
+    mutable bool compiled{true};
+
+    static inline ushort fold(QChar ch) { return ch.toCaseFolded().unicode(); }
+    static inline quint64 edge(int state, ushort ch) { return (quint64(state) << 16) | ch; }
+
+    int step(int state, ushort ch) const
+    {
+        forever
+        {
+            auto it = transitions.constFind(edge(state, ch));
+            if (it != transitions.constEnd()) return it.value();
+            if (state == 0) return 0;
+            state = states.at(state).fail;
+        }
+    }
+
+    void compile() const
+    {
+        // Process the states in order of depth, so that the fail state of each
+        // state's parent has already been calculated.
+        LinkageList *self = const_cast<LinkageList*>(this);
+        QVector<int> order(states.size() - 1);
+        for (int i = 1; i < states.size(); i++) order[i-1] = i;
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return states.at(a).depth < states.at(b).depth; });
+        for (int s : order)
+        {
+            State &state = self->states[s];
+            state.fail = (state.parent == 0) ? 0 : step(states.at(state.parent).fail, state.ch);
+            const State &fail = states.at(state.fail);
+            state.dict = (fail.output >= 0) ? state.fail : fail.dict;
+        }
+        compiled = true;
+    }
 
 public:
     void clear()
     {
-        map.clear();
-        maxlen = 0;
+        states = QVector<State>{State()};
+        transitions.clear();
+        ids.clear();
+        symbols.clear();
+        lengths.clear();
+        compiled = true;
     }
 
-    void add(const QString &name, const QString &id)
+    void add(const QString &name, const QString &id, int symbol = -1)
     {
-        if (name.length() > maxlen) maxlen = name.length();
-        map.insert(name.toUpper(), id);
+        if (name.isEmpty()) return;
+        int state = 0;
+        for (QChar ch : name)
+        {
+            const ushort folded = fold(ch);
+            auto it = transitions.constFind(edge(state, folded));
+            if (it != transitions.constEnd())
+                state = it.value();
+            else
+            {
+                State next;
+                next.parent = state;
+                next.ch     = folded;
+                next.depth  = states.at(state).depth + 1;
+                states.append(next);
+                transitions.insert(edge(state, folded), states.size() - 1);
+                state = states.size() - 1;
+            }
+        }
+        // A repeated name replaces the earlier target
+        if (states.at(state).output >= 0)
+        {
+            ids[states.at(state).output] = id;
+            symbols[states.at(state).output] = symbol;
+        }
+        else
+        {
+            states[state].output = ids.size();
+            ids.append(id);
+            symbols.append(symbol);
+            lengths.append(name.length());
+        }
+        compiled = false;
     }
 
+    /**
+     * @brief find
+     * @param text
+     * @return the target_id of the name which matches all of text, or a null string
+     */
     QString find(const QString &text) const
     {
         static const QString null_string;
-        if (!map.isEmpty() && text.length() <= maxlen)
+        int state = 0;
+        for (QChar ch : text)
+        {
+            auto it = transitions.constFind(edge(state, fold(ch)));
+            if (it == transitions.constEnd()) return null_string;
+            state = it.value();
+        }
+        const int output = states.at(state).output;
+        return (output >= 0) ? ids.at(output) : null_string;
+    }
+
+    /**
+     * @brief search
+     * Finds all the names which appear as whole words within text.
+     * Where names overlap, the one which starts first (and then the longest) is chosen.
+     * @param text
+     * @param matches set to the matches in order of position within text
+     */
+    void search(const QString &text, Matches &matches) const
+    {
+        matches.clear();
+        if (ids.isEmpty()) return;
+        if (!compiled) compile();
+
+        const int length = text.length();
+        int state = 0;
+        for (int pos = 0; pos < length; pos++)
+        {
+            state = step(state, fold(text.at(pos)));
+            for (int s = (states.at(state).output >= 0) ? state : states.at(state).dict; s >= 0; s = states.at(s).dict)
+            {
+                const int name  = states.at(s).output;
+                const int start = pos + 1 - lengths.at(name);
+                // Only match whole words
+                if ((start == 0 || !text.at(start-1).isLetterOrNumber()) &&
+                        (pos+1 == length || !text.at(pos+1).isLetterOrNumber()))
+                {
+                    matches.append(Match{start, lengths.at(name), ids.at(name), symbols.at(name)});
+                }
+            }
+        }
+        if (matches.size() < 2) return;
+
+        // Remove overlapping matches
+        std::sort(matches.begin(), matches.end(), [](const Match &a, const Match &b) {
+            return a.start < b.start || (a.start == b.start && a.length > b.length); });
+        int keep = 0;
+        for (int i = 1; i < matches.size(); i++)
+        {
+            if (matches.at(i).start >= matches.at(keep).start + matches.at(keep).length)
+                matches[++keep] = matches.at(i);
+        }
+        matches.resize(keep + 1);
+    }
+
+    /**
+     * @brief markup
+     * Returns text with each linked name replaced using format,
+     * where %1 is the target_id and %2 is the name as it appears in text.
+     * @param text
+     * @param format
+     * @return
+     */
+    QString markup(const QString &text, const QString &format) const
+    {
+        Matches matches;
+        search(text, matches);
+        if (matches.isEmpty()) return text;
+
+        QString result;
+        int pos = 0;
+        for (const auto &match : matches)
         {
-            return map.value(text.toUpper(), null_string);
+            result.append(text.midRef(pos, match.start - pos));
+            result.append(format.arg(match.target_id, text.mid(match.start, match.length)));
+            pos = match.start + match.length;
         }
-        return null_string;
+        result.append(text.midRef(pos));
+        return result;
     }
 };
 
@@ -16,11 +16,20 @@
 */
 
 #include "mainwindow.h"
+#include "outputmarkdown.h"
 #include <QApplication>
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+#ifdef BENCHMARK_DICE
+    // Run the benchmark instead of the application
+    if (a.arguments().contains("--benchmark-dice"))
+    {
+        benchmarkDice();
+        return 0;
+    }
+#endif
     QCoreApplication::setOrganizationName("Amusing Time");
     QCoreApplication::setOrganizationDomain("amusingtime.uk");
     QCoreApplication::setApplicationName("RWoutput");
@@ -18,7 +18,10 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 
-#undef GEN_TEXT_DOCUMENT
+// Build the QTextDocument for PDF/print from the same HTML4 as outHtml4Subset, but with the images
+// added as decoded resources (and the PDF written a topic at a time), rather than via QTextDocument::setHtml
+// of the complete HTML4 with base64 images.
+#define GEN_TEXT_DOCUMENT
 
 #include <QDebug>
 #include <QFileDialog>
@@ -37,6 +40,8 @@
 #include <QDialogButtonBox>
 
 #include "xmlelement.h"
+#include "imageasset.h"
+#include "portfolio.h"
 #include "outputhtml.h"
 #include "outhtml4subset.h"
 #include "outputfgmod.h"
@@ -69,6 +74,7 @@ MainWindow::MainWindow(QWidget *parent) :
     //ui->saveFgMod->setIcon(style()->standardIcon(QStyle::SP_DialogSaveButton));
     //ui->print->setIcon(style()->standardIcon(QStyle::));
     ui->simpleHtml->setIcon(style()->standardIcon(QStyle::SP_DialogSaveButton));
+    ui->saveAll->setIcon(style()->standardIcon(QStyle::SP_DialogSaveButton));
     // No options available until a file has been loaded.
     ui->rwexport->setEnabled(false);
     ui->rwoutput->setEnabled(false);
@@ -77,6 +83,9 @@ MainWindow::MainWindow(QWidget *parent) :
 
     connect(ui->separateTopicFiles, &QCheckBox::clicked, ui->indexOnEveryPage, &QCheckBox::setEnabled);
     ui->indexOnEveryPage->setEnabled(ui->separateTopicFiles->isChecked());
+    ui->maxVolumeSize->setValidator(new QIntValidator(1,100000));
+    connect(ui->separateTopicFiles, &QCheckBox::clicked, ui->maxVolumeSize, &QLineEdit::setDisabled);
+    ui->maxVolumeSize->setDisabled(ui->separateTopicFiles->isChecked());
 
     QSettings settings;
     for (auto *widget : ui->centralWidget->findChildren<QCheckBox*>())
@@ -86,6 +95,8 @@ MainWindow::MainWindow(QWidget *parent) :
     }
     QVariant value = settings.value("image/maxWidth");
     if (value.isValid()) ui->maxImageWidth->setText(value.toString());
+    value = settings.value("html/maxVolumeSize");
+    if (value.isValid()) ui->maxVolumeSize->setText(value.toString());
 }
 
 MainWindow::~MainWindow()
@@ -102,6 +113,7 @@ void MainWindow::saveSettings()
         settings.setValue("checked/" + widget->objectName(), widget->isChecked());
     }
     settings.setValue("image/maxWidth", ui->maxImageWidth->text());
+    settings.setValue("html/maxVolumeSize", ui->maxVolumeSize->text());
 }
 
 int MainWindow::maxWidth()
@@ -117,6 +129,18 @@ int MainWindow::maxWidth()
     return number;
 }
 
+/**
+ * @brief MainWindow::maxVolumeSize
+ * @return the size (in bytes) of each volume of a single HTML file, or 0 for no limit
+ */
+qint64 MainWindow::maxVolumeSize()
+{
+    bool ok = true;
+    qint64 number = ui->maxVolumeSize->text().toLongLong(&ok);
+    if (!ok || number <= 0) return 0;
+    return number * 1000 * 1000;
+}
+
 
 void MainWindow::setStatusText(const QString &text)
 {
@@ -136,6 +160,10 @@ bool MainWindow::loadFile(const QString &in_filename)
         delete root_element;
         root_element = nullptr;
     }
+    // Prepared images, portfolios and IDs belong to the old data
+    clearImageAssets();
+    clearPortfolios();
+    XmlElement::clearSymbols();
 
     in_file.setFileName(in_filename);
 
@@ -208,13 +236,17 @@ void MainWindow::on_saveHtml_clicked()
     setStatusText("Saving XHTML file...");
     qApp->processEvents();
 
-    toHtml(path, root_element,
-           maxWidth(),
-           separate_files,
-           ui->revealMask->isChecked(),
-           separate_files && ui->indexOnEveryPage->isChecked());
-
-    setStatusText("XHTML file SAVE complete.");
+    const int failed_files = toHtml(path, root_element,
+                                    maxWidth(),
+                                    separate_files,
+                                    ui->revealMask->isChecked(),
+                                    separate_files && ui->indexOnEveryPage->isChecked(),
+                                    separate_files ? 0 : maxVolumeSize());
+
+    if (failed_files > 0)
+        setStatusText(QString("Failed to write %1 XHTML file(s).").arg(failed_files));
+    else
+        setStatusText("XHTML file SAVE complete.");
     qApp->processEvents();
     saveSettings();
 }
@@ -270,32 +302,35 @@ void MainWindow::on_saveMarkdown_clicked()
     setStatusText("Saving Markdown file...");
     qApp->processEvents();
 
-    toMarkdown(root_element,
-               maxWidth(),
-               settings.value("obsidian/useLeaflet").toBool(),
-               ui->revealMask->isChecked(),
-               ui->foldersByCategory->isChecked(),
-               ui->useWikilinks->isChecked(),
-               ui->createNavPanel->isChecked(),
-               ui->tagForEachPrefix->isChecked(),
-               ui->tagForEachSuffix->isChecked(),
-               settings.value("obsidian/useMermaid").toBool(),
-               settings.value("obsidian/useDiceRollsSnippets").toBool(),
-               settings.value("obsidian/useDiceRollsHtml").toBool(),
-               ui->decodeStatblocks->isChecked(),
-               settings.value("obsidian/use5estatblocks").toBool(),
-               settings.value("obsidian/useAdmonitionGMdir").toBool(),
-               settings.value("obsidian/useAdmonitionStyles").toBool(),
-               settings.value("obsidian/fmLabeledText").toBool(),
-               settings.value("obsidian/fmNumeric").toBool(),
-               settings.value("obsidian/fmPrefixSuffix").toBool(),
-               settings.value("obsidian/useInitiativeTracker").toBool(),
-               settings.value("obsidian/useTableExtended").toBool(),
-               settings.value("obsidian/createCategoryTemplates").toBool(),
-               ui->linkPorFile->isChecked()
-               );
-
-    setStatusText("Markdown file SAVE complete.");
+    const int failed_files = toMarkdown(root_element,
+                                        maxWidth(),
+                                        settings.value("obsidian/useLeaflet").toBool(),
+                                        ui->revealMask->isChecked(),
+                                        ui->foldersByCategory->isChecked(),
+                                        ui->useWikilinks->isChecked(),
+                                        ui->createNavPanel->isChecked(),
+                                        ui->tagForEachPrefix->isChecked(),
+                                        ui->tagForEachSuffix->isChecked(),
+                                        settings.value("obsidian/useMermaid").toBool(),
+                                        settings.value("obsidian/useDiceRollsSnippets").toBool(),
+                                        settings.value("obsidian/useDiceRollsHtml").toBool(),
+                                        ui->decodeStatblocks->isChecked(),
+                                        settings.value("obsidian/use5estatblocks").toBool(),
+                                        settings.value("obsidian/useAdmonitionGMdir").toBool(),
+                                        settings.value("obsidian/useAdmonitionStyles").toBool(),
+                                        settings.value("obsidian/fmLabeledText").toBool(),
+                                        settings.value("obsidian/fmNumeric").toBool(),
+                                        settings.value("obsidian/fmPrefixSuffix").toBool(),
+                                        settings.value("obsidian/useInitiativeTracker").toBool(),
+                                        settings.value("obsidian/useTableExtended").toBool(),
+                                        settings.value("obsidian/createCategoryTemplates").toBool(),
+                                        ui->linkPorFile->isChecked()
+                                        );
+
+    if (failed_files > 0)
+        setStatusText(QString("Failed to write %1 Markdown file(s).").arg(failed_files));
+    else
+        setStatusText("Markdown file SAVE complete.");
     qApp->processEvents();
     saveSettings();
 }
@@ -329,12 +364,12 @@ void MainWindow::on_savePdf_clicked()
         return;
     }
 
+#ifndef GEN_TEXT_DOCUMENT
     static QTextDocument doc;
     doc.clear();
     // Ensure layout uses correct margins (and hide page numbers)
     doc.setPageSize(printer.pageRect().size());
 
-#ifndef GEN_TEXT_DOCUMENT
     setStatusText("Generating HTML4 subset contents...");
     {
         QString result;   // only keep long enough to call doc.setHtml
@@ -343,8 +378,6 @@ void MainWindow::on_savePdf_clicked()
         setStatusText("Transferring to QTextDocument...");
         doc.setHtml(result);
     }
-#else
-    genTextDocument(doc, root_element, maxWidth(), ui->revealMask->isChecked());
 #endif
 
     setStatusText("Saving PDF file...");
@@ -353,7 +386,12 @@ void MainWindow::on_savePdf_clicked()
     pdf.setTitle(QFileInfo(in_file).baseName());
     pdf.setPdfVersion(QPdfWriter::PdfVersion_1_6);  /* Allows Embedded fonts, rather than linked */
     pdf.setPageLayout(printer.pageLayout());
+#ifndef GEN_TEXT_DOCUMENT
     doc.print(&pdf);
+#else
+    // Each topic is laid out and written separately, so the whole campaign is never in one QTextDocument
+    genPdf(pdf, printer.pageRect().size(), root_element, maxWidth(), ui->revealMask->isChecked());
+#endif
     setStatusText("PDF file SAVE complete.");
 }
 
@@ -369,6 +407,7 @@ void MainWindow::on_print_clicked()
     // Ensure layout uses correct margins (and hide page numbers)
     doc.setPageSize(printer.pageRect().size());
 
+#ifndef GEN_TEXT_DOCUMENT
     setStatusText("Generating HTML4 subset contents...");
     {
         QString result;   // only keep long enough to call doc.setHtml
@@ -377,6 +416,10 @@ void MainWindow::on_print_clicked()
         setStatusText("Transferring to QTextDocument...");
         doc.setHtml(result);
     }
+#else
+    setStatusText("Generating QTextDocument...");
+    genTextDocument(doc, root_element, maxWidth(), ui->revealMask->isChecked());
+#endif
 
     setStatusText("Printing...");
     doc.print(&printer);
@@ -418,6 +461,119 @@ void MainWindow::on_simpleHtml_clicked()
     saveSettings();
 }
 
+/**
+ * @brief MainWindow::on_saveAll_clicked
+ * Generate all of the RWoutput formats into a single directory, using the current settings.
+ * The formats are generated one after the other on the loaded tree (the writers keep file-static state,
+ * and the PDF has to be created on the GUI thread). The decompressed portfolios are kept until every
+ * format has been written, and the images prepared for the XHTML are reused by the HTML4 writer
+ * (while they fit in the image cache). Embedded HTML is translated again by each writer,
+ * since each one releases it as it goes.
+ */
+void MainWindow::on_saveAll_clicked()
+{
+    QSettings settings;
+    const QString SAVE_DIRECTORY_PARAM("outputDirectory");
+
+    QString path = QFileDialog::getExistingDirectory(this, tr("Output Directory"),
+                                                     /*dir*/ settings.value(SAVE_DIRECTORY_PARAM, QFileInfo(in_file).absolutePath()).toString());
+    if (path.isEmpty()) return;
+    QDir dir(path);
+
+    if (!dir.exists())
+    {
+        setStatusText("The directory does not exist!");
+        qApp->processEvents();
+        return;
+    }
+    settings.setValue(SAVE_DIRECTORY_PARAM, dir.absolutePath());
+    QDir::setCurrent(dir.absolutePath());
+
+    const QString basename = QFileInfo(in_file).baseName();
+    const int max_width = maxWidth();
+    const bool reveal_mask = ui->revealMask->isChecked();
+
+    // XHTML
+    setStatusText("Saving XHTML file...");
+    qApp->processEvents();
+    bool separate_files = ui->separateTopicFiles->isChecked();
+    // The portfolios are shared by all the formats
+    keepPortfolios(true);
+    int failed_files = toHtml(separate_files ? dir.absolutePath() : dir.filePath(basename + ".xhtml"),
+                              root_element,
+                              max_width,
+                              separate_files,
+                              reveal_mask,
+                              separate_files && ui->indexOnEveryPage->isChecked(),
+                              separate_files ? 0 : maxVolumeSize());
+
+    // HTML4
+    setStatusText("Saving HTML4 file...");
+    qApp->processEvents();
+#ifndef GEN_TEXT_DOCUMENT
+    QString html4;
+    {
+        QTextStream stream(&html4, QIODevice::WriteOnly|QIODevice::Text);
+        outHtml4Subset(stream, root_element, max_width, reveal_mask);
+    }
+#endif
+    QFile file(dir.filePath(basename + ".html"));
+    if (file.open(QFile::WriteOnly|QFile::Text))
+    {
+        QTextStream stream(&file);
+#ifndef GEN_TEXT_DOCUMENT
+        stream << html4;
+#else
+        outHtml4Subset(stream, root_element, max_width, reveal_mask);
+#endif
+        file.close();
+    }
+    else
+    {
+        qWarning() << "Failed to open output file" << file.fileName();
+        failed_files++;
+    }
+
+    // PDF, using the default page layout
+    setStatusText("Saving PDF file...");
+    qApp->processEvents();
+    QFile pdf_file(dir.filePath(basename + ".pdf"));
+    if (pdf_file.open(QFile::WriteOnly))
+    {
+        QPrinter printer;
+#ifndef GEN_TEXT_DOCUMENT
+        QTextDocument doc;
+        doc.setPageSize(printer.pageRect().size());
+        doc.setHtml(html4);
+        html4.clear();
+#endif
+
+        QPdfWriter pdf(&pdf_file);
+        pdf.setCreator("RWout");
+        pdf.setTitle(basename);
+        pdf.setPdfVersion(QPdfWriter::PdfVersion_1_6);  /* Allows Embedded fonts, rather than linked */
+        pdf.setPageLayout(printer.pageLayout());
+#ifndef GEN_TEXT_DOCUMENT
+        doc.print(&pdf);
+#else
+        genPdf(pdf, printer.pageRect().size(), root_element, max_width, reveal_mask);
+#endif
+    }
+    else
+    {
+        qWarning() << "Failed to open PDF file" << pdf_file.fileName();
+        failed_files++;
+    }
+    keepPortfolios(false);
+
+    if (failed_files > 0)
+        setStatusText(QString("Failed to write %1 file(s).").arg(failed_files));
+    else
+        setStatusText("All files SAVE complete.");
+    qApp->processEvents();
+    saveSettings();
+}
+
 void MainWindow::on_mapPins_clicked()
 {
     QSettings settings;
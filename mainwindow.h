@@ -43,6 +43,7 @@ private slots:
     void on_savePdf_clicked();
     void on_print_clicked();
     void on_simpleHtml_clicked();
+    void on_saveAll_clicked();
     void on_mapPins_clicked();
     void on_saveFgMod_clicked();    
     void on_obsidianPlugins_clicked();
@@ -52,6 +53,7 @@ private:
     QFile in_file;
     void setStatusText(const QString &text);
     int maxWidth();
+    qint64 maxVolumeSize();
     void saveSettings();
 };
 
@@ -15,19 +15,20 @@
 #include <QProgressDialog>
 #include <future>
 #include "linkage.h"
+#include "portfolio.h"
+#include "topicsorter.h"
+#include "imageasset.h"
 #ifdef TIME_CONVERSION
 #include <QElapsedTimer>
 #endif
 
-#include <quazip/quazip.h>
-#include <quazip/quazipfile.h>
 
 #define DEBUG_LEVEL 0
 
 static int image_max_width = -1;
 static bool apply_reveal_mask = true;
 static bool sort_by_prefix = true;
-static QCollator collator;
+static Html4ImageSource image_source = nullptr;
 
 // Some predefined Styles
 static const QString FLAVOR_STYLE{"background-color: rgb(239,212,210);"};
@@ -38,32 +39,7 @@ static const QString ANNOTATION_STYLE{"font-style: italic; margin-left: 10px;"};
 
 static LinkageList links;
 
-// Sort topics, first by prefix, and then by topic name
-static bool sort_all_topics(const XmlElement *left, const XmlElement *right)
-{
-    if (sort_by_prefix)
-    {
-        // items with prefix come before items without prefix
-        const QString &left_prefix  = left->attribute("prefix");
-        const QString &right_prefix = right->attribute("prefix");
-        if (left_prefix != right_prefix)
-        {
-            if (right_prefix.isEmpty())
-            {
-                // left prefix is not empty, so must come first
-                return true;
-            }
-            if (left_prefix.isEmpty())
-            {
-                // right prefix is not empty, so must come first
-                return false;
-            }
-            return collator.compare(left_prefix, right_prefix) < 0;
-        }
-    }
-    // Both have the same prefix
-    return collator.compare(left->attribute("public_name"), right->attribute("public_name")) < 0;
-}
+static TopicSorter topic_sorter;
 
 
 static QString write_attributes(const XmlElement *elem, const QString &style)
@@ -72,7 +48,7 @@ static QString write_attributes(const XmlElement *elem, const QString &style)
     QTextStream stream(&result);
     bool done_style = false;
 
-    for (auto attr : elem->attributes())
+    for (const auto &attr : elem->attributes())
     {
         // Ignore attributes which won't do anything in the HTML4 subset.
         if (attr.name == "style")
@@ -107,11 +83,7 @@ static void write_span(QTextStream &stream, const XmlElement *elem, const QStrin
         QString text = elem->fixedText();
         // TODO - the span containing the link might have style or class information!
         // Check to see if the fixed text should be replaced with a link.
-        QString link_text = links.find(text);
-        if (!link_text.isNull())
-        {
-            text = QString("<a href='#%1'>%2</a>").arg(link_text).arg(text);
-        }
+        text = links.markup(text, "<a href='#%1'>%2</a>");
         if (style.isEmpty())
             stream << text;
         else
@@ -120,7 +92,7 @@ static void write_span(QTextStream &stream, const XmlElement *elem, const QStrin
     else
     {
         // Only put in span if we really require it
-        bool in_element = elem->objectName() != "span" || elem->hasAttribute("style") || !style.isEmpty();
+        bool in_element = elem->objectName() != "span" || elem->hasAttribute(XmlElement::KEY_STYLE) || !style.isEmpty();
         if (in_element)
         {
             stream << QString("<%1 %2>").arg(elem->objectName()).arg(write_attributes(elem, style));
@@ -243,11 +215,6 @@ static int write_image(QTextStream &stream, const QString &image_name, const QBy
     qDebug() << "....writeImage: image" << image_name << ", file" << filename << ", size" << orig_data.size();
 #endif
 
-    QBuffer buffer;
-    QString format = filename.split(".").last();
-    int divisor = 1;
-    bool in_buffer = false;
-
     stream << "<p>";
 
     if (annotation)
@@ -255,82 +222,21 @@ static int write_image(QTextStream &stream, const QString &image_name, const QBy
     else
         stream << QString("<b>Image: %1</b>").arg(image_name);
 
-    // See if possible image conversion is required
-    bool bad_format = (format == "bmp" || format == "tif");
-    if (mask_elem != nullptr || image_max_width > 0 || bad_format)
+    if (image_source)
     {
-#ifdef THREADED
-        // Only one thread at a time can use QImage
-        std::unique_lock<std::mutex> lock{image_mutex};
-#endif
-
-        QImage image = QImage::fromData(orig_data, qPrintable(format));
-        if (bad_format)
-        {
-            format = "png";
-            in_buffer = true;
-        }
-
-        if (mask_elem != nullptr || (image_max_width > 0 && image.width() > image_max_width))
-        {
-            // Apply mask, if supplied
-            if (mask_elem && apply_reveal_mask)
-            {
-                // If the mask is empty, then don't use it
-                // (if the image is JPG, the mask isn't necessarily JPG
-                QImage mask = QImage::fromData(mask_elem->byteData());
-
-                // Ensure we have a 32-bit image to convert
-                image = image.convertToFormat(QImage::Format_RGB32);
-
-                // Create a mask with the correct alpha
-                QPixmap pixmap(image.size());
-                pixmap.fill(QColor(0, 0, 0, 200));
-                pixmap.setMask(QBitmap::fromImage(mask));
-
-                if (image.size() != mask.size())
-                {
-                    qWarning() << "Image size differences for" << filename << ": image =" << image.size() << ", mask =" << mask.size();
-                }
-                // Apply the mask to the original picture
-                QPainter painter(&image);
-                painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
-                painter.drawPixmap(0, 0, pixmap);
-            }
-
-            // Reduce width in a binary fashion, so maximum detail is kept.
-            if (image_max_width > 0)
-            {
-                int orig_width = image.size().width();
-                int new_width  = orig_width;
-                while (new_width > image_max_width)
-                {
-                    divisor = divisor << 1;
-                    new_width = new_width >> 1;
-                }
-                if (divisor > 1)
-                {
-                    image = image.scaledToWidth(new_width, Qt::SmoothTransformation);
-                }
-            }
-            //format = "png";   // not always better (especially if was JPG)
-            in_buffer = true;
-        }
-        // Do we need to put it in the buffer?
-        if (in_buffer)
-        {
-            buffer.open(QIODevice::WriteOnly);
-            image.save(&buffer, qPrintable(format));
-            buffer.close();
-            in_buffer = true;
-        }
+        // The image is supplied separately (e.g. as a resource of the QTextDocument)
+        stream << image_source(orig_data, mask_elem, filename) << "\n";
+        return 1;
     }
 
-    stream << QString("<img src='data:image/%1;base64,").arg(format);
-    stream << (in_buffer ? buffer.data() : orig_data).toBase64();
+    // Format conversion, mask and scaling are shared with the other output formats
+    const ImageAsset asset = prepareImage(orig_data, filename, mask_elem, apply_reveal_mask, image_max_width);
+
+    stream << QString("<img src='data:image/%1;base64,").arg(asset.format);
+    stream << asset.data.toBase64();
     stream << "'>\n";
 
-    return divisor;
+    return asset.divisor;
 }
 
 static void write_ext_object(QTextStream &stream, const QString &obj_name, const QByteArray &data,
@@ -384,8 +290,8 @@ static QByteArray get_body(const QByteArray &source)
 
 static void write_snippet(QTextStream &stream, const XmlElement *snippet)
 {
-    QString sn_type = snippet->attribute("type");
-    QString sn_style = snippet->attribute("style"); // Read_Aloud, Callout, Flavor, Handout
+    QString sn_type = snippet->attribute(XmlElement::KEY_TYPE);
+    QString sn_style = snippet->attribute(XmlElement::KEY_STYLE); // Read_Aloud, Callout, Flavor, Handout
 #if DEBUG_LEVEL > 3
     qDebug() << "...snippet" << sn_type;
 #endif
@@ -433,26 +339,16 @@ static void write_snippet(QTextStream &stream, const XmlElement *snippet)
                     stream << "</u></b>\n";
 
                     // Put in markers for statblock
-                    QByteArray store = contents->byteData();
-                    QBuffer buffer(&store);
-                    QuaZip zip(&buffer);
-                    if (zip.open(QuaZip::mdUnzip))
+                    const Portfolio portfolio = readPortfolio(contents->byteData());
+                    if (portfolio.valid)
                     {
-                        for (bool more=zip.goToFirstFile(); more; more=zip.goToNextFile())
+                        for (const auto &file : portfolio.files)
                         {
-                            if (zip.getCurrentFileName().startsWith("statblocks_html/"))
+                            if (file.name.startsWith("statblocks_html/"))
                             {
-                                QuaZipFile file(&zip);
-                                if (file.open(QuaZipFile::ReadOnly))
-                                {
-                                    stream << "<div style='border: 1px solid tan; padding: 2px; margin 5px; background-color: azure;'>";
-                                    stream << get_body(file.readAll());
-                                    stream << "</div>\n";
-                                }
-                                else
-                                {
-                                    qWarning() << "GUMBO failed to parse" << zip.getCurrentFileName();
-                                }
+                                stream << "<div style='border: 1px solid tan; padding: 2px; margin 5px; background-color: azure;'>";
+                                stream << get_body(file.data);
+                                stream << "</div>\n";
                             }
                         }
                     }
@@ -533,12 +429,12 @@ static void write_snippet(QTextStream &stream, const XmlElement *snippet)
                     stream->writeStartElement("area");
                     stream->writeAttribute("shape", "circle");
                     stream->writeAttribute("coords", QString("%1,%2,%3")
-                                           .arg(pin->attribute("x").toInt() / divisor)
-                                           .arg(pin->attribute("y").toInt() / divisor)
+                                           .arg(pin->intAttribute("x") / divisor)
+                                           .arg(pin->intAttribute("y") / divisor)
                                            .arg(10));
                     QString title = pin->attribute("pin_name");
                     if (!title.isEmpty()) stream->writeAttribute("title", title);
-                    QString link = pin->attribute("topic_id");
+                    QString link = pin->attribute(XmlElement::KEY_TOPIC_ID);
                     if (!link.isEmpty()) writeTopicHref(stream, link);
 
                     XmlElement *description = pin->xmlChild("description");
@@ -646,10 +542,10 @@ static void write_section(QTextStream &stream, const XmlElement *section, int le
 }
 
 
-static void write_topic(QTextStream &stream, const XmlElement *topic)
+static void write_topic(QTextStream &stream, const XmlElement *topic, bool page_break = true)
 {
 #if DEBUG_LEVEL > 1
-    qDebug() << ".topic" << topic->objectName() << ":" << topic->attribute("public_name");
+    qDebug() << ".topic" << topic->objectName() << ":" << topic->attribute(XmlElement::KEY_PUBLIC_NAME);
 #endif
 
     // Process <linkage> first, to ensure we can remap strings
@@ -663,11 +559,13 @@ static void write_topic(QTextStream &stream, const XmlElement *topic)
     }
 
     // HTML4 allows an anchor to be defined with "<a name='id'>"
-    stream << QString("<h1 align='center' style='page-break-before: always; background-color: gainsboro;'><a name='%1'>").arg(topic->attribute("topic_id"));
+    stream << QString("<h1 align='center' style='%1background-color: gainsboro;'><a name='%2'>")
+              .arg(page_break ? "page-break-before: always; " : "")
+              .arg(topic->attribute(XmlElement::KEY_TOPIC_ID));
 
-    if (topic->hasAttribute("prefix")) stream << QString("%1 - ").arg(topic->attribute("prefix"));
-    stream << topic->attribute("public_name");
-    if (topic->hasAttribute("suffix")) stream << QString(" (%1)").arg(topic->attribute("suffix"));
+    if (topic->hasAttribute(XmlElement::KEY_PREFIX)) stream << QString("%1 - ").arg(topic->attribute(XmlElement::KEY_PREFIX));
+    stream << topic->attribute(XmlElement::KEY_PUBLIC_NAME);
+    if (topic->hasAttribute(XmlElement::KEY_SUFFIX)) stream << QString(" (%1)").arg(topic->attribute(XmlElement::KEY_SUFFIX));
     stream << "</a></h1>\n";
 
     // Maybe some aliases (in own section for smaller font?)
@@ -680,11 +578,13 @@ static void write_topic(QTextStream &stream, const XmlElement *topic)
     for (auto section: topic->xmlChildren("section"))
     {
         write_section(stream, section, /*level*/ 1);
+        // Embedded HTML is not needed again, so release the memory
+        section->releaseTranslations();
     }
 
     // Provide summary of links to child topics
     auto child_topics = topic->xmlChildren("topic");
-    std::sort(child_topics.begin(), child_topics.end(), sort_all_topics);
+    topic_sorter.sort(child_topics, sort_by_prefix);
 
     if (!child_topics.isEmpty())
     {
@@ -692,7 +592,7 @@ static void write_topic(QTextStream &stream, const XmlElement *topic)
         stream << "<ul>";
         for (auto child: child_topics)
         {
-            stream << QString("<li><a href='#%1'>%2</a>\n").arg(child->attribute("topic_id")).arg(child->attribute("public_name"));
+            stream << QString("<li><a href='#%1'>%2</a>\n").arg(child->attribute(XmlElement::KEY_TOPIC_ID)).arg(child->attribute(XmlElement::KEY_PUBLIC_NAME));
         }
         stream << "</ul>\n";
     }
@@ -739,6 +639,53 @@ static void write_first_page(QTextStream &stream, const XmlElement *root_elem)
         stream << QString("<h2>Other Notes</h2>\n<p>%1\n").arg(details->attribute("other_notes"));
 }
 
+/**
+ * @brief startHtml4Subset
+ * Prepares for writing the HTML4 subset of the tree, one piece at a time
+ * (outHtml4Subset does this for the whole tree in one go).
+ * @param root a pointer to the root XmlElement of the tree
+ * @param max_image_width maximum width of an image
+ * @param use_reveal_mask whether the reveal mask of the images should be used
+ * @param source if set, supplies the <img> element for each image instead of a data URI
+ * @return all of the topics, in the order in which they should be written
+ */
+QList<XmlElement*> startHtml4Subset(const XmlElement *root,
+                                    int max_image_width,
+                                    bool use_reveal_mask,
+                                    Html4ImageSource source)
+{
+    image_max_width   = max_image_width;
+    apply_reveal_mask = use_reveal_mask;
+    image_source      = source;
+    auto topics = root->findChildren<XmlElement*>("topic");
+    topic_sorter.clear();
+    topic_sorter.addTopics(topics);
+    topic_sorter.sort(topics, sort_by_prefix);
+    return topics;
+}
+
+void outHtml4FirstPage(QTextStream &stream, const XmlElement *root)
+{
+    write_first_page(stream, root);
+}
+
+/**
+ * @brief outHtml4Topic
+ * Writes one topic (but not its child topics, which are separate entries in the list from startHtml4Subset).
+ * @param page_break false if the topic shouldn't start on a new page (e.g. at the start of a document)
+ */
+void outHtml4Topic(QTextStream &stream, const XmlElement *topic, bool page_break)
+{
+    write_topic(stream, topic, page_break);
+}
+
+void finishHtml4Subset()
+{
+    image_source = nullptr;
+    clearPortfolios();
+}
+
+
 /**
  * @brief outHtml4Subset
  * This routine puts the supplied XmlElement tree into the supplied QTextStream using the HTML 4
@@ -758,20 +705,16 @@ void outHtml4Subset(QTextStream &stream,
     QElapsedTimer timer;
     timer.start();
 #endif
-    image_max_width   = max_image_width;
-    apply_reveal_mask = use_reveal_mask;
-    collator.setNumericMode(true);
+    auto topics = startHtml4Subset(root, max_image_width, use_reveal_mask);
+    preparePortfolios(root);
 
     stream << "<meta http-equiv='Content-Type' content='text/html; charset='utf-8' />\n";
 
     write_first_page(stream, root);
 
-    auto topics = root->findChildren<XmlElement*>("topic");
     QProgressDialog pbar("Generating HTML4", QString(), 0, topics.count());
     pbar.show();
 
-    std::sort(topics.begin(), topics.end(), sort_all_topics);
-
     int count = 0;
     for (auto topic : topics)
     {
@@ -779,6 +722,7 @@ void outHtml4Subset(QTextStream &stream,
         write_topic(stream, topic);
         qApp->processEvents();
     }
+    finishHtml4Subset();
 #ifdef TIME_CONVERSION
     qInfo() << "TIME TO GENERATE HTML =" << timer.elapsed() << "milliseconds";
 #endif
@@ -10,4 +10,16 @@ void outHtml4Subset(QTextStream &stream,
                     int max_image_width,
                     bool use_reveal_mask);
 
+// Returns the complete <img> element for an image, instead of one with the image in a data URI.
+typedef QString (*Html4ImageSource)(const QByteArray &orig_data, const XmlElement *mask_elem, const QString &filename);
+
+// For generating the HTML4 a piece at a time (see gentextdocument.cpp)
+QList<XmlElement*> startHtml4Subset(const XmlElement *root,
+                                    int max_image_width,
+                                    bool use_reveal_mask,
+                                    Html4ImageSource image_source = nullptr);
+void outHtml4FirstPage(QTextStream &stream, const XmlElement *root);
+void outHtml4Topic(QTextStream &stream, const XmlElement *topic, bool page_break = true);
+void finishHtml4Subset();
+
 #endif // OUTHTML4SUBSET_H
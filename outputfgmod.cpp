@@ -3,15 +3,19 @@
 #include <QBuffer>
 #include <QDebug>
 #include <QFile>
-#include <QBitmap>
 #include <QImage>
 #include <QPainter>
 #include <QStaticText>
 #include <QString>
 #include <QTemporaryDir>
+#include <QXmlStreamReader>
 #include <QXmlStreamWriter>
 
 #include "xmlelement.h"
+#include "imageasset.h"
+#include "portfolio.h"
+#include "symboltable.h"
+#include "rendercache.h"
 #include <quazip/quazip.h>
 #include <quazip/quazipfile.h>
 #include <quazip/JlCompress.h>
@@ -22,7 +26,8 @@ static int topic_id = 0;
 static int image_max_width = -1;
 static bool apply_reveal_mask = true;
 
-static QMap<QString,const XmlElement*> all_topics;
+static SymbolTable<const XmlElement*> all_topics;
+static RenderCache<QByteArray> html_cache;     // embedded HTML already converted during this conversion
 static QMap<QString,QStaticText> category_pin_of_topic;
 static QMap<QString,const XmlElement*> topics_for_sections;
 
@@ -73,9 +78,9 @@ static void write_start_category(QXmlStreamWriter &stream)
 
 static QString topic_name(const XmlElement *topic)
 {
-    QString name = topic->attribute("public_name");
-    QString prefix = topic->attribute("prefix");
-    QString suffix = topic->attribute("suffix");
+    QString name = topic->attribute(XmlElement::KEY_PUBLIC_NAME);
+    QString prefix = topic->attribute(XmlElement::KEY_PREFIX);
+    QString suffix = topic->attribute(XmlElement::KEY_SUFFIX);
     if (!prefix.isEmpty()) name.prepend(prefix + " - ");
     if (!suffix.isEmpty()) name.append(" (" + suffix + ")");
     return name;
@@ -194,7 +199,7 @@ static void dump_children(const QString &from, const GumboNode *parent)
 }
 #endif
 
-static bool write_html(QXmlStreamWriter &stream, bool use_fixed_title, const QString &sntype, const QByteArray &data)
+static bool render_html(QXmlStreamWriter &stream, bool use_fixed_title, const QString &sntype, const QByteArray &data)
 {
     // Put the children of the BODY into this frame.
     GumboOutput *output = gumbo_parse(data);
@@ -264,6 +269,83 @@ static bool write_html(QXmlStreamWriter &stream, bool use_fixed_title, const QSt
     return true;
 }
 
+/**
+ * @brief replay_fragment
+ * Writes the elements of a fragment from html_cache through stream,
+ * so that they are indented and encoded in the same way as the rest of the output.
+ * @param stream
+ * @param fragment the XML of the fragment, inside a single wrapper element
+ */
+static void replay_fragment(QXmlStreamWriter &stream, const QByteArray &fragment)
+{
+    QXmlStreamReader reader(fragment);
+    int depth = 0;
+    while (!reader.atEnd())
+    {
+        switch (reader.readNext())
+        {
+        case QXmlStreamReader::StartElement:
+            // Don't copy the wrapper element
+            if (depth++ > 0) stream.writeCurrentToken(reader);
+            break;
+        case QXmlStreamReader::EndElement:
+            if (--depth > 0) stream.writeCurrentToken(reader);
+            break;
+        case QXmlStreamReader::Characters:
+        case QXmlStreamReader::Comment:
+        case QXmlStreamReader::EntityReference:
+            stream.writeCurrentToken(reader);
+            break;
+        default:
+            break;
+        }
+    }
+    if (reader.hasError()) qWarning() << "replay_fragment: invalid cached fragment:" << reader.errorString();
+}
+
+/**
+ * @brief readable_fragment
+ * Checks that the fragment can be read back by replay_fragment.
+ * QXmlStreamWriter will write attribute names which gumbo accepts but which aren't valid XML
+ * (e.g. "@click" or names starting with a digit), and QXmlStreamReader stops at them.
+ */
+static bool readable_fragment(const QByteArray &fragment)
+{
+    QXmlStreamReader reader(fragment);
+    while (!reader.atEnd()) reader.readNext();
+    return !reader.hasError();
+}
+
+/**
+ * @brief write_html
+ * As render_html, but a fragment which has already been converted during this conversion
+ * (e.g. the same statblock in several topics) is copied from html_cache.
+ * A fragment which can't be read back is rendered directly each time (it is cached as an empty array).
+ */
+static bool write_html(QXmlStreamWriter &stream, bool use_fixed_title, const QString &sntype, const QByteArray &data)
+{
+    const QByteArray key = RenderCache<QByteArray>::key(data, sntype + (use_fixed_title ? "|fixed" : "|title"));
+    QByteArray fragment;
+    if (!html_cache.find(key, fragment))
+    {
+        // The fragment is cached as unformatted UTF-8 XML, in a single wrapper element so that it can be read back;
+        // the formatting of the real output is applied when it is replayed.
+        QBuffer buffer(&fragment);
+        buffer.open(QBuffer::WriteOnly);
+        QXmlStreamWriter fragment_stream(&buffer);
+        fragment_stream.setCodec("UTF-8");
+        fragment_stream.writeStartElement("fragment");
+        if (!render_html(fragment_stream, use_fixed_title, sntype, data)) return false;
+        fragment_stream.writeEndElement();  // fragment
+        buffer.close();
+        if (!readable_fragment(fragment)) fragment.clear();
+        html_cache.insert(key, fragment);
+    }
+    if (fragment.isEmpty()) return render_html(stream, use_fixed_title, sntype, data);
+    replay_fragment(stream, fragment);
+    return true;
+}
+
 static QString simple_para_text(XmlElement *p)
 {
     // Collect all spans into a single paragraph (without formatting)
@@ -315,10 +397,9 @@ static inline QString build_tooltip(const QString &title, const QString &descrip
     return result;
 }
 
-static inline void get_summary(const QString &topic_id, QString &description, QString &gm_directions)
+static inline void get_summary(const XmlElement *topic, QString &description, QString &gm_directions)
 {
     // First section - all Multi_Line snippet - contents/gm_directions - p - span
-    const XmlElement *topic = all_topics.value(topic_id);
     if (!topic) return;
 
     const XmlElement *section = topic->xmlChild("section");
@@ -330,7 +411,7 @@ static inline void get_summary(const QString &topic_id, QString &description, QS
     bool first_gm = true;
     for (auto snippet : section->xmlChildren("snippet"))
     {
-        if (snippet->attribute("type") != "Multi_Line") continue;
+        if (snippet->attribute(XmlElement::KEY_TYPE) != "Multi_Line") continue;
 
         if (add_desc)
         {
@@ -386,11 +467,7 @@ static int write_image(QXmlStreamWriter &stream, const QString &image_name, cons
                        const QString &filename, const QString &class_name, XmlElement *annotation,
                        const QString &usemap = QString(), const QList<XmlElement*> pins = QList<XmlElement*>())
 {
-    QBuffer buffer;
-    QString format = filename.split(".").last();
-    int divisor = 1;
     const int pin_size = 20;
-    bool in_buffer = false;
 
     stream.writeStartElement("p");
 
@@ -403,143 +480,81 @@ static int write_image(QXmlStreamWriter &stream, const QString &image_name, cons
         write_characters(stream, image_name);
     stream.writeEndElement();  // figcaption
 
-    // See if possible image conversion is required
-    bool bad_format = (format == "bmp" || format == "tif");
-    if (mask_elem != nullptr || image_max_width > 0 || bad_format || !pins.isEmpty())
-    {
-#ifdef THREADED
-        // Only one thread at a time can use QImage
-        std::unique_lock<std::mutex> lock{image_mutex};
-#endif
-
-        QImage image = QImage::fromData(orig_data, qPrintable(format));
-        if (bad_format)
-        {
-            format = "png";
-            in_buffer = true;
-        }
-
-        if (mask_elem != nullptr || (image_max_width > 0 && image.width() > image_max_width))
-        {
-            // Apply mask, if supplied
-            if (mask_elem && apply_reveal_mask)
-            {
-                // If the mask is empty, then don't use it
-                // (if the image is JPG, the mask isn't necessarily JPG
-                QImage mask = QImage::fromData(mask_elem->byteData());
-
-                // Ensure we have a 32-bit image to convert
-                image = image.convertToFormat(QImage::Format_RGB32);
+    // Format conversion, mask and scaling are shared with the other output formats
+    // (the pins are drawn on the decoded image, so that the image is only compressed once)
+    ImageAsset asset;
+    QImage image;
+    if (pins.isEmpty())
+        asset = prepareImage(orig_data, filename, mask_elem, apply_reveal_mask, image_max_width);
+    else
+        image = prepareImagePixels(orig_data, filename, mask_elem ? mask_elem->byteData() : QByteArray(),
+                                   apply_reveal_mask, image_max_width, asset);
+    const int divisor = asset.divisor;
 
-                // Create a mask with the correct alpha
-                QPixmap pixmap(image.size());
-                pixmap.fill(QColor(0, 0, 0, 200));
-                pixmap.setMask(QBitmap::fromImage(mask));
+    // Add some graphics to show where PINS will be
+    if (!pins.isEmpty())
+    {
 
-                if (image.size() != mask.size())
-                {
-                    qWarning() << "Image size differences for" << filename << ": image =" << image.size() << ", mask =" << mask.size();
-                }
-                // Apply the mask to the original picture
-                QPainter painter(&image);
-                painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
-                painter.drawPixmap(0, 0, pixmap);
-            }
+        // Set desired colour of the marker
+        QPainter painter(&image);
+        painter.setPen(QPen(Qt::red));
 
-            // Reduce width in a binary fashion, so maximum detail is kept.
-            if (image_max_width > 0)
-            {
-                int orig_width = image.size().width();
-                int new_width  = orig_width;
-                while (new_width > image_max_width)
-                {
-                    divisor = divisor << 1;
-                    new_width = new_width >> 1;
-                }
-                if (divisor > 1)
-                {
-                    image = image.scaledToWidth(new_width, Qt::SmoothTransformation);
-                }
-            }
-            //format = "png";   // not always better (especially if was JPG)
-            in_buffer = true;
-        } /* mask or scaling */
+        // Set correct font size
+        QFont font(painter.font());
+        font.setPixelSize(pin_size-1);
+        painter.setFont(font);
 
-        // Add some graphics to show where PINS will be
-        if (!pins.isEmpty())
+        // Create string once
+        static QStaticText default_pin_text;
+        static bool first_time = true;
+        if (first_time)
         {
-            // Set desired colour of the marker
-            QPainter painter(&image);
-            painter.setPen(QPen(Qt::red));
-
-            // Set correct font size
-            QFont font(painter.font());
-            font.setPixelSize(pin_size-1);
-            painter.setFont(font);
-
-            // Create string once
-            static QStaticText default_pin_text;
-            static bool first_time = true;
-            if (first_time)
-            {
-                first_time = false;
-                /* UNICODE : 1F4CC = map marker (push pin) */
-                /* original = bottom-left corner */
-                uint pin_char = 0x1f4cd;
-                default_pin_text.setText(QString::fromUcs4(&pin_char, 1));
-                default_pin_text.prepare(QTransform(), font);
-            }
-            // TODO - select pin appropriate to the type of topic to which it is linked!
-            // The "category_name" attribute of each "topic" element is what needs to be matched to a pin_text
-            for (XmlElement *pin : pins)
+            first_time = false;
+            /* UNICODE : 1F4CC = map marker (push pin) */
+            /* original = bottom-left corner */
+            uint pin_char = 0x1f4cd;
+            default_pin_text.setText(QString::fromUcs4(&pin_char, 1));
+            default_pin_text.prepare(QTransform(), font);
+        }
+        // TODO - select pin appropriate to the type of topic to which it is linked!
+        // The "category_name" attribute of each "topic" element is what needs to be matched to a pin_text
+        for (XmlElement *pin : pins)
+        {
+            const QString topic_name = pin->attribute(XmlElement::KEY_TOPIC_ID);
+            if (!topic_name.isEmpty() && !category_pin_of_topic.contains(topic_name))
             {
-                const QString topic_name = pin->attribute("topic_id");
-                if (!topic_name.isEmpty() && !category_pin_of_topic.contains(topic_name))
-                {
-                    QString category;
-                    if (all_topics.contains(topic_name))
-                        category = all_topics[topic_name]->attribute("category_name");
-                    else
-                        category = "..generic..";
-
-                    // Find the category of the named topic (if any).
-                    uint pin_char = 0x1f4cc;    // round pin
-                    QStaticText cat_pin;
-                    cat_pin.setText(QString::fromUcs4(&pin_char, 1));
-                    cat_pin.prepare(QTransform(), font);
-                    category_pin_of_topic.insert(topic_name, cat_pin);
-                }
-
-                painter.setPen(QPen(Qt::blue));
-                const QStaticText &pin_text = topic_name.isEmpty() ? default_pin_text : category_pin_of_topic.value(topic_name);
-                painter.drawStaticText(pin->attribute("x").toInt() / divisor,
-                                       pin->attribute("y").toInt() / divisor - pin_text.size().height(),
-                                       pin_text);
+                QString category;
+                const XmlElement::SymbolId topic_symbol = pin->symbolAttribute(XmlElement::KEY_TOPIC_ID);
+                if (all_topics.contains(topic_symbol))
+                    category = all_topics.value(topic_symbol)->attribute("category_name");
+                else
+                    category = "..generic..";
+
+                // Find the category of the named topic (if any).
+                uint pin_char = 0x1f4cc;    // round pin
+                QStaticText cat_pin;
+                cat_pin.setText(QString::fromUcs4(&pin_char, 1));
+                cat_pin.prepare(QTransform(), font);
+                category_pin_of_topic.insert(topic_name, cat_pin);
             }
 
-            // Tell the next bit to read from the buffer
-            in_buffer = true;
-        } /* pins */
-
-        // Do we need to put it in the buffer?
-        if (in_buffer)
-        {
-            buffer.open(QIODevice::WriteOnly);
-            image.save(&buffer, qPrintable(format));
-            buffer.close();
-            in_buffer = true;
+            painter.setPen(QPen(Qt::blue));
+            const QStaticText &pin_text = topic_name.isEmpty() ? default_pin_text : category_pin_of_topic.value(topic_name);
+            painter.drawStaticText(pin->intAttribute("x") / divisor,
+                                   pin->intAttribute("y") / divisor - pin_text.size().height(),
+                                   pin_text);
         }
-    }
+        painter.end();
+
+        // The pins are only for this output, so the image isn't shared with the other writers
+        encodeImage(image, asset);
+    } /* pins */
 
     stream.writeStartElement("img");
     if (!usemap.isEmpty()) stream.writeAttribute("usemap", "#" + usemap);
     stream.writeAttribute("alt", image_name);
-    if (in_buffer)
-        stream.writeAttribute("src", QString("data:image/%1;base64,%2").arg(format)
-                               .arg(QString::fromLatin1(buffer.data().toBase64())));
-    else
-        stream.writeAttribute("src", QString("data:image/%1;base64,%2").arg(format)
-                               .arg(QString::fromLatin1(orig_data.toBase64())));
+    stream.writeAttribute("src", QString("data:image/%1;base64,%2").arg(asset.format)
+                           .arg(QString::fromLatin1(asset.data.toBase64())));
     stream.writeEndElement();  // img
 
     if (!pins.isEmpty())
@@ -549,8 +564,8 @@ static int write_image(QXmlStreamWriter &stream, const QString &image_name, cons
         stream.writeAttribute("name", usemap);
         for (auto pin : pins)
         {
-            int x = pin->attribute("x").toInt() / divisor;
-            int y = pin->attribute("y").toInt() / divisor - pin_size;
+            int x = pin->intAttribute("x") / divisor;
+            int y = pin->intAttribute("y") / divisor - pin_size;
             stream.writeStartElement("area");
             stream.writeAttribute("shape", "rect");
             stream.writeAttribute("coords", QString("%1,%2,%3,%4")
@@ -561,12 +576,12 @@ static int write_image(QXmlStreamWriter &stream, const QString &image_name, cons
             QString pin_name = pin->attribute("pin_name");
             QString description = get_elem_string(pin->xmlChild("description"));
             QString gm_directions = get_elem_string(pin->xmlChild("gm_directions"));
-            QString link = pin->attribute("topic_id");
+            QString link = pin->attribute(XmlElement::KEY_TOPIC_ID);
             // OPTION - use first section of topic if no description or gm_directions is provided
             if (show_full_map_pin_tooltip && (description.isEmpty() || gm_directions.isEmpty()) && !link.isEmpty())
             {
                 // Read topic summary from first section
-                get_summary(link, description, gm_directions);
+                get_summary(all_topics.value(pin->symbolAttribute(XmlElement::KEY_TOPIC_ID)), description, gm_directions);
             }
             QString title = build_tooltip(pin_name, description, gm_directions);
             if (!title.isEmpty()) stream.writeAttribute("title", title);
@@ -646,7 +661,7 @@ static void write_span(QXmlStreamWriter &stream, XmlElement *elem, const QString
 #endif
 
         // Only put in span if we really require it
-        bool in_element = elem->objectName() != "span" || elem->hasAttribute("style") || !classname.isEmpty();
+        bool in_element = elem->objectName() != "span" || elem->hasAttribute(XmlElement::KEY_STYLE) || !classname.isEmpty();
         if (in_element)
         {
             //stream.writeStartElement(elem->objectName());
@@ -743,8 +758,8 @@ static void write_para_children(QXmlStreamWriter &stream, XmlElement *parent, co
 
 static void write_snippet(QXmlStreamWriter &stream, XmlElement *snippet)
 {
-    QString sn_type = snippet->attribute("type");
-    QString sn_style = snippet->attribute("style"); // Read_Aloud, Callout, Flavor, Handout
+    QString sn_type = snippet->attribute(XmlElement::KEY_TYPE);
+    QString sn_style = snippet->attribute(XmlElement::KEY_STYLE); // Read_Aloud, Callout, Flavor, Handout
 #if DEBUG_LEVEL > 3
     qDebug() << "..snippet" << sn_type;
 #endif
@@ -782,22 +797,18 @@ static void write_snippet(QXmlStreamWriter &stream, XmlElement *snippet)
                                    filename, sn_style, annotation);
 
                     // Put in markers for statblock
-                    QByteArray store = contents->byteData();
-                    QBuffer buffer(&store);
-                    QuaZip zip(&buffer);
-                    if (zip.open(QuaZip::mdUnzip))
+                    const Portfolio portfolio = readPortfolio(contents->byteData());
+                    if (portfolio.valid)
                     {
                         stream.writeStartElement("section");
                         stream.writeAttribute("class", "portfolioListing");
-                        for (bool more=zip.goToFirstFile(); more; more=zip.goToNextFile())
+                        for (const auto &file : portfolio.files)
                         {
-                            if (zip.getCurrentFileName().startsWith("statblocks_html/"))
+                            if (file.name.startsWith("statblocks_html/"))
                             {
-                                QuaZipFile file(&zip);
-                                if (!file.open(QuaZipFile::ReadOnly) ||
-                                        !write_html(stream, false, sn_type, file.readAll()))
+                                if (!write_html(stream, false, sn_type, file.data))
                                 {
-                                    qWarning() << "GUMBO failed to parse" << zip.getCurrentFileName();
+                                    qWarning() << "GUMBO failed to parse" << file.name;
                                 }
                             }
                         }
@@ -976,9 +987,9 @@ static void write_topic(QXmlStreamWriter &stream, const XmlElement *topic)
 {
     topic_id++;
 #if DEBUG_LEVEL > 3
-    qDebug() << "topic" << topic->attribute("topic_id");
+    qDebug() << "topic" << topic->attribute(XmlElement::KEY_TOPIC_ID);
 #endif
-    stream.writeStartElement(topic->attribute("topic_id"));
+    stream.writeStartElement(topic->attribute(XmlElement::KEY_TOPIC_ID));
 
     stream.writeStartElement("name");
     stream.writeAttribute("type", "string");
@@ -994,6 +1005,8 @@ static void write_topic(QXmlStreamWriter &stream, const XmlElement *topic)
     {
         ++levels[0];
         write_section(stream, section, levels);
+        // Embedded HTML is not needed again, so release the memory
+        section->releaseTranslations();
     }
 
     // Write list of child topics
@@ -1007,7 +1020,7 @@ static void write_topic(QXmlStreamWriter &stream, const XmlElement *topic)
         {
             stream.writeStartElement("link");
             stream.writeAttribute("class", "encounter");
-            stream.writeAttribute("recordname", "encounter." + child->attribute("topic_id"));
+            stream.writeAttribute("recordname", "encounter." + child->attribute(XmlElement::KEY_TOPIC_ID));
             write_characters(stream, topic_name(child));
             stream.writeEndElement();   // link
         }
@@ -1156,6 +1169,7 @@ void toFgMod(const QString &path,
     image_max_width   = 2048;
     apply_reveal_mask = use_reveal_mask;
     topics_for_sections = section_topics;
+    html_cache.clear();
 
     QString curpath = QDir::currentPath();
 
@@ -1174,6 +1188,12 @@ void toFgMod(const QString &path,
     // create db.xml
     create_db(tempdir, root_elem);
 
+#if DEBUG_LEVEL > 0
+    qDebug() << "EMBEDDED HTML: converted" << html_cache.misses() << "fragments, reused" << html_cache.hits();
+#endif
+    html_cache.clear();
+    clearPortfolios();
+
     // zip up the contents into a file with .mod extension
     QDir::setCurrent(curpath);
     QuaZipFile zipfile(path);
@@ -0,0 +1,149 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "outputfile.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QMutex>
+#include <QQueue>
+#include <QWaitCondition>
+#include <thread>
+
+//#define PRINT_OUTPUT_FILES
+
+struct PendingFile
+{
+    QString filename;
+    QByteArray data;
+};
+
+// Stop creating new files when this much data is waiting to be written
+static const qint64 max_queued_bytes = 64 * 1024 * 1024;
+
+static QMutex queue_mutex;
+static QWaitCondition queue_changed;
+static QQueue<PendingFile> pending_files;
+static qint64 queued_bytes = 0;
+static bool writer_running = false;
+static int failed_files = 0;        // since the last call to waitForOutputFiles
+
+
+/**
+ * @brief run_writer
+ * Writes each batch of pending files in turn; the thread finishes as soon as nothing is left to write.
+ */
+static void run_writer()
+{
+    QMutexLocker lock(&queue_mutex);
+    while (!pending_files.isEmpty())
+    {
+        QQueue<PendingFile> batch;
+        batch.swap(pending_files);
+        lock.unlock();
+
+        qint64 written = 0;
+        int failed = 0;
+        for (const auto &pending : qAsConst(batch))
+        {
+            QFile file(pending.filename);
+            if (!file.open(QFile::WriteOnly))
+            {
+                qWarning() << "Failed to open output file" << pending.filename << ":" << file.errorString();
+                failed++;
+            }
+            else if (file.write(pending.data) != pending.data.size() || !file.flush())
+            {
+                qWarning() << "Failed to write output file" << pending.filename << ":" << file.errorString();
+                failed++;
+            }
+#ifdef PRINT_OUTPUT_FILES
+            qDebug() << "OutputFile: written" << pending.filename << pending.data.size() << "bytes";
+#endif
+            written += pending.data.size();
+        }
+
+        lock.relock();
+        queued_bytes -= written;
+        failed_files += failed;
+        queue_changed.wakeAll();
+    }
+    writer_running = false;
+    queue_changed.wakeAll();
+}
+
+
+static void queue_file(const QString &filename, const QByteArray &data)
+{
+    QMutexLocker lock(&queue_mutex);
+    // Don't allow the memory used by waiting files to grow without limit
+    while (queued_bytes > max_queued_bytes && writer_running)
+        queue_changed.wait(&queue_mutex);
+
+    pending_files.enqueue(PendingFile{filename, data});
+    queued_bytes += data.size();
+    if (!writer_running)
+    {
+        writer_running = true;
+        std::thread(run_writer).detach();
+    }
+}
+
+
+OutputFile::OutputFile(const QString &name) :
+    p_filename(name)
+{
+}
+
+
+OutputFile::~OutputFile()
+{
+    // QBuffer's destructor won't call our version of close()
+    if (isOpen()) close();
+}
+
+
+/**
+ * @brief OutputFile::close
+ * Passes the contents of the file to the background thread to be written.
+ */
+void OutputFile::close()
+{
+    if (!isOpen()) return;
+    QByteArray contents = buffer();
+    QBuffer::close();
+    setData(QByteArray());
+    queue_file(p_filename, contents);
+}
+
+
+/**
+ * @brief waitForOutputFiles
+ * Waits until every OutputFile that has been closed has been written to disk.
+ * @return the number of files which could not be written since the previous call
+ */
+int waitForOutputFiles()
+{
+    QMutexLocker lock(&queue_mutex);
+    while (writer_running || !pending_files.isEmpty())
+        queue_changed.wait(&queue_mutex);
+    const int failed = failed_files;
+    failed_files = 0;
+    return failed;
+}
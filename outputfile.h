@@ -0,0 +1,48 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef OUTPUTFILE_H
+#define OUTPUTFILE_H
+
+#include <QBuffer>
+
+/**
+ * @brief The OutputFile class
+ * A file which is built in memory and then handed to a background thread to be written to disk
+ * when it is closed (or destroyed), so that creating the contents never waits for the disk.
+ *
+ * It can be used in place of a QFile by QTextStream and QXmlStreamWriter.
+ * The file is always written from the start (truncating any existing file).
+ */
+class OutputFile : public QBuffer
+{
+public:
+    OutputFile(const QString &name);
+    ~OutputFile();
+
+    QString fileName() const { return p_filename; }
+    void close() override;
+
+private:
+    QString p_filename;
+};
+
+int waitForOutputFiles();
+
+#endif // OUTPUTFILE_H
@@ -21,36 +21,40 @@
 
 #include "outputhtml.h"
 
-#include <QBitmap>
 #include <QBuffer>
 #include <QCollator>
 #include <QDebug>
+#include <QDir>
 #include <QFile>
+#include <QFileInfo>
 #include <QImage>
 #include <QPainter>
-#include <QPixmap>
 #include <QApplication>
 #include <QStyle>
 #include <QStaticText>
+#include <QXmlStreamReader>
 #include <future>
 #ifdef TIME_CONVERSION
 #include <QElapsedTimer>
 #endif
 
 #include "gumbo.h"
-#include <quazip/quazip.h>
-#include <quazip/quazipfile.h>
 
 #include "xmlelement.h"
+#include "imageasset.h"
 #include "linefile.h"
 #include "linkage.h"
+#include "topicsorter.h"
+#include "outputfile.h"
+#include "portfolio.h"
+#include "symboltable.h"
+#include "rendercache.h"
 
 static int image_max_width = -1;
 static bool apply_reveal_mask = true;
 static bool always_show_index = false;
 static bool in_single_file = false;
 static bool sort_by_prefix = true;
-static QCollator collator;
 
 #if 1
 typedef QFile OurFile;
@@ -63,7 +67,11 @@ typedef LineFile OurFile;
 static const QStringList predefined_styles = { "Normal", "Read_Aloud", "Handout", "Flavor", "Callout" };
 static QMap<QString /*style string*/ ,QString /*replacement class name*/> class_of_style;
 static QMap<QString,QStaticText> category_pin_of_topic;
-static QMap<QString,XmlElement*> all_topics;
+static SymbolTable<XmlElement*> all_topics;
+static RenderCache<QByteArray> html_cache;     // embedded HTML already converted during this conversion
+static SymbolTable<int> topic_volume;          // key=topic_id, value=volume containing that topic (single file only)
+static QStringList volume_files;               // filename of each volume, when a single file is split
+static int current_volume = 0;                 // the volume being written
 
 const QString map_pin_title_default("___ %1 ___");
 const QString map_pin_description_default("%1");
@@ -78,32 +86,7 @@ bool show_full_map_pin_tooltip = true;
 
 #define DUMP_LEVEL 0
 
-// Sort topics, first by prefix, and then by topic name
-static bool sort_all_topics(const XmlElement *left, const XmlElement *right)
-{
-    if (sort_by_prefix)
-    {
-        // items with prefix come before items without prefix
-        const QString &left_prefix  = left->attribute("prefix");
-        const QString &right_prefix = right->attribute("prefix");
-        if (left_prefix != right_prefix)
-        {
-            if (right_prefix.isEmpty())
-            {
-                // left prefix is not empty, so must come first
-                return true;
-            }
-            if (left_prefix.isEmpty())
-            {
-                // right prefix is not empty, so must come first
-                return false;
-            }
-            return collator.compare(left_prefix, right_prefix) < 0;
-        }
-    }
-    // Both have the same prefix
-    return collator.compare(left->attribute("public_name"), right->attribute("public_name")) < 0;
-}
+static TopicSorter topic_sorter;
 
 
 /**
@@ -323,10 +306,9 @@ static inline QString build_tooltip(const QString &title, const QString &descrip
  * First section - all Multi_Line snippet - contents/gm_directions - p - span
  */
 
-static inline void get_summary(const QString &topic_id, QString &description, QString &gm_directions)
+static inline void get_summary(const XmlElement *topic, QString &description, QString &gm_directions)
 {
     // First section - all Multi_Line snippet - contents/gm_directions - p - span
-    const XmlElement *topic = all_topics.value(topic_id);
     if (!topic) return;
 
     const XmlElement *section = topic->xmlChild("section");
@@ -338,7 +320,7 @@ static inline void get_summary(const QString &topic_id, QString &description, QS
     bool first_gm = true;
     for (auto snippet : section->xmlChildren("snippet"))
     {
-        if (snippet->attribute("type") != "Multi_Line") continue;
+        if (snippet->attribute(XmlElement::KEY_TYPE) != "Multi_Line") continue;
 
         if (add_desc)
         {
@@ -385,7 +367,7 @@ static void write_attributes(QXmlStreamWriter *stream, const XmlElement *elem, c
 {
     QStringList class_names;
     if (!classname.isEmpty()) class_names.append(classname);
-    for (auto attr : elem->attributes())
+    for (const auto &attr : elem->attributes())
     {
         if (attr.name == "style")
         {
@@ -403,20 +385,27 @@ static void write_attributes(QXmlStreamWriter *stream, const XmlElement *elem, c
 }
 
 
-static void write_topic_href(QXmlStreamWriter *stream, const QString &topic_id, bool add_title=true)
+static void write_topic_href(QXmlStreamWriter *stream, const QString &topic_id, XmlElement::SymbolId symbol, bool add_title=true)
 {
     if (in_single_file)
-        stream->writeAttribute("href", "#" + topic_id);
+    {
+        // Topics in another volume need the name of that file too
+        const int volume = topic_volume.value(symbol);
+        if (volume > 0 && volume != current_volume && volume <= volume_files.size())
+            stream->writeAttribute("href", volume_files.at(volume-1) + "#" + topic_id);
+        else
+            stream->writeAttribute("href", "#" + topic_id);
+    }
     else
         stream->writeAttribute("href", topic_id + ".xhtml");
     if (add_title && show_full_link_tooltip)
     {
-        if (const XmlElement *topic = all_topics.value(topic_id))
+        if (const XmlElement *topic = all_topics.value(symbol))
         {
             QString description;
             QString gm_directions;
-            get_summary(topic_id, description, gm_directions);
-            QString tooltip = build_tooltip(topic->attribute("public_name"), description, gm_directions);
+            get_summary(topic, description, gm_directions);
+            QString tooltip = build_tooltip(topic->attribute(XmlElement::KEY_PUBLIC_NAME), description, gm_directions);
             if (!tooltip.isEmpty()) stream->writeAttribute("title", tooltip);
         }
     }
@@ -434,21 +423,27 @@ static void write_span(QXmlStreamWriter *stream, XmlElement *elem, const Linkage
         // TODO - the span containing the link might have style or class information!
         // Check to see if the fixed text should be replaced with a link.
         const QString text = elem->fixedText();
-        const QString link_text = links.find(text);
-        if (!link_text.isNull())
+        LinkageList::Matches matches;
+        links.search(text, matches);
+        int pos = 0;
+        for (const auto &match : matches)
         {
+            if (match.start > pos) stream->writeCharacters(text.mid(pos, match.start - pos));
             stream->writeStartElement("a");
-            write_topic_href(stream, link_text);
-            stream->writeCharacters(text);  // case might be different
+            write_topic_href(stream, match.target_id, match.target_symbol);
+            stream->writeCharacters(text.mid(match.start, match.length));  // case might be different
             stream->writeEndElement();  // a
-            return;
+            pos = match.start + match.length;
         }
-        stream->writeCharacters(text);
+        if (pos == 0)
+            stream->writeCharacters(text);
+        else if (pos < text.length())
+            stream->writeCharacters(text.mid(pos));
     }
     else
     {
         // Only put in span if we really require it
-        bool in_element = elem->objectName() != "span" || elem->hasAttribute("style") || !classname.isEmpty();
+        bool in_element = elem->objectName() != "span" || elem->hasAttribute(XmlElement::KEY_STYLE) || !classname.isEmpty();
         if (in_element)
         {
             stream->writeStartElement(elem->objectName());
@@ -547,6 +542,33 @@ static QString get_elem_string(XmlElement *elem)
     return elem->childString().replace("&#xd;\n","\n");
 }
 
+/**
+ * @brief write_data_attribute
+ * Writes an attribute containing a "data:" URL of the given data.
+ * The BASE64 is written in small chunks directly to the output device,
+ * so that no full-size copies of the (possibly very large) data are created.
+ * It must be called while the start tag is still open, i.e. after writeStartElement/writeAttribute.
+ * @param stream
+ * @param name the name of the attribute
+ * @param mime_type
+ * @param data
+ */
+static void write_data_attribute(QXmlStreamWriter *stream, const QString &name, const QString &mime_type, const QByteArray &data)
+{
+    QIODevice *device = stream->device();
+    if (device == nullptr)
+    {
+        stream->writeAttribute(name, "data:" + mime_type + ";base64," + QString::fromLatin1(data.toBase64()));
+        return;
+    }
+    // QXmlStreamWriter has already written everything up to the end of the previous attribute.
+    device->write(QString(" %1=\"data:%2;base64,").arg(name, mime_type).toUtf8());
+    const int chunk = 3 * 16384;     // a multiple of 3, so that there is no padding between chunks
+    for (int pos = 0; pos < data.size(); pos += chunk)
+        device->write(QByteArray::fromRawData(data.constData() + pos, qMin(chunk, data.size() - pos)).toBase64());
+    device->write("\"");
+}
+
 /*
  * Return the divisor for the map's size
  */
@@ -559,11 +581,7 @@ static int write_image(QXmlStreamWriter *stream, const QString &image_name, cons
                        const QString &filename, const QString &class_name, XmlElement *annotation, const LinkageList &links,
                        const QString &usemap = QString(), const QList<XmlElement*> pins = QList<XmlElement*>())
 {
-    QBuffer buffer;
-    QString format = filename.split(".").last();
-    int divisor = 1;
     const int pin_size = 20;
-    bool in_buffer = false;
 
     stream->writeStartElement("p");
 
@@ -576,143 +594,84 @@ static int write_image(QXmlStreamWriter *stream, const QString &image_name, cons
         stream->writeCharacters(image_name);
     stream->writeEndElement();  // figcaption
 
-    // See if possible image conversion is required
-    bool bad_format = (format == "bmp" || format == "tif");
-    if (mask_elem != nullptr || image_max_width > 0 || bad_format || !pins.isEmpty())
-    {
 #ifdef THREADED
-        // Only one thread at a time can use QImage
-        std::unique_lock<std::mutex> lock{image_mutex};
+    // Only one thread at a time can use QImage
+    std::unique_lock<std::mutex> lock{image_mutex};
 #endif
+    // Format conversion, mask and scaling are shared with the other output formats
+    // (the pins are drawn on the decoded image, so that the image is only compressed once)
+    ImageAsset asset;
+    QImage image;
+    if (pins.isEmpty())
+        asset = prepareImage(orig_data, filename, mask_elem, apply_reveal_mask, image_max_width);
+    else
+        image = prepareImagePixels(orig_data, filename, mask_elem ? mask_elem->byteData() : QByteArray(),
+                                   apply_reveal_mask, image_max_width, asset);
+    const int divisor = asset.divisor;
 
-        QImage image = QImage::fromData(orig_data, qPrintable(format));
-        if (bad_format)
-        {
-            format = "png";
-            in_buffer = true;
-        }
-
-        if (mask_elem != nullptr || (image_max_width > 0 && image.width() > image_max_width))
-        {
-            // Apply mask, if supplied
-            if (mask_elem && apply_reveal_mask)
-            {
-                // If the mask is empty, then don't use it
-                // (if the image is JPG, the mask isn't necessarily JPG
-                QImage mask = QImage::fromData(mask_elem->byteData());
-
-                // Ensure we have a 32-bit image to convert
-                image = image.convertToFormat(QImage::Format_RGB32);
+    // Add some graphics to show where PINS will be
+    if (!pins.isEmpty())
+    {
 
-                // Create a mask with the correct alpha
-                QPixmap pixmap(image.size());
-                pixmap.fill(QColor(0, 0, 0, 200));
-                pixmap.setMask(QBitmap::fromImage(mask));
+        // Set desired colour of the marker
+        QPainter painter(&image);
+        painter.setPen(QPen(Qt::red));
 
-                if (image.size() != mask.size())
-                {
-                    qWarning() << "Image size differences for" << filename << ": image =" << image.size() << ", mask =" << mask.size();
-                }
-                // Apply the mask to the original picture
-                QPainter painter(&image);
-                painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
-                painter.drawPixmap(0, 0, pixmap);
-            }
-
-            // Reduce width in a binary fashion, so maximum detail is kept.
-            if (image_max_width > 0)
-            {
-                int orig_width = image.size().width();
-                int new_width  = orig_width;
-                while (new_width > image_max_width)
-                {
-                    divisor = divisor << 1;
-                    new_width = new_width >> 1;
-                }
-                if (divisor > 1)
-                {
-                    image = image.scaledToWidth(new_width, Qt::SmoothTransformation);
-                }
-            }
-            //format = "png";   // not always better (especially if was JPG)
-            in_buffer = true;
-        } /* mask or scaling */
+        // Set correct font size
+        QFont font(painter.font());
+        font.setPixelSize(pin_size-1);
+        painter.setFont(font);
 
-        // Add some graphics to show where PINS will be
-        if (!pins.isEmpty())
+        // Create string once
+        static QStaticText default_pin_text;
+        static bool first_time = true;
+        if (first_time)
         {
-            // Set desired colour of the marker
-            QPainter painter(&image);
-            painter.setPen(QPen(Qt::red));
-
-            // Set correct font size
-            QFont font(painter.font());
-            font.setPixelSize(pin_size-1);
-            painter.setFont(font);
-
-            // Create string once
-            static QStaticText default_pin_text;
-            static bool first_time = true;
-            if (first_time)
-            {
-                first_time = false;
-                /* UNICODE : 1F4CC = map marker (push pin) */
-                /* original = bottom-left corner */
-                uint pin_char = 0x1f4cd;
-                default_pin_text.setText(QString::fromUcs4(&pin_char, 1));
-                default_pin_text.prepare(QTransform(), font);
-            }
-            // TODO - select pin appropriate to the type of topic to which it is linked!
-            // The "category_name" attribute of each "topic" element is what needs to be matched to a pin_text
-            for (XmlElement *pin : pins)
+            first_time = false;
+            /* UNICODE : 1F4CC = map marker (push pin) */
+            /* original = bottom-left corner */
+            uint pin_char = 0x1f4cd;
+            default_pin_text.setText(QString::fromUcs4(&pin_char, 1));
+            default_pin_text.prepare(QTransform(), font);
+        }
+        // TODO - select pin appropriate to the type of topic to which it is linked!
+        // The "category_name" attribute of each "topic" element is what needs to be matched to a pin_text
+        for (XmlElement *pin : pins)
+        {
+            const QString topic_name = pin->attribute(XmlElement::KEY_TOPIC_ID);
+            if (!topic_name.isEmpty() && !category_pin_of_topic.contains(topic_name))
             {
-                const QString topic_name = pin->attribute("topic_id");
-                if (!topic_name.isEmpty() && !category_pin_of_topic.contains(topic_name))
-                {
-                    QString category;
-                    if (all_topics.contains(topic_name))
-                        category = all_topics[topic_name]->attribute("category_name");
-                    else
-                        category = "..generic..";
-
-                    // Find the category of the named topic (if any).
-                    uint pin_char = 0x1f4cc;    // round pin
-                    QStaticText cat_pin;
-                    cat_pin.setText(QString::fromUcs4(&pin_char, 1));
-                    cat_pin.prepare(QTransform(), font);
-                    category_pin_of_topic.insert(topic_name, cat_pin);
-                }
-
-                painter.setPen(QPen(Qt::blue));
-                const QStaticText &pin_text = topic_name.isEmpty() ? default_pin_text : category_pin_of_topic.value(topic_name);
-                painter.drawStaticText(pin->attribute("x").toInt() / divisor,
-                                       pin->attribute("y").toInt() / divisor - pin_text.size().height(),
-                                       pin_text);
+                QString category;
+                const XmlElement::SymbolId topic_symbol = pin->symbolAttribute(XmlElement::KEY_TOPIC_ID);
+                if (all_topics.contains(topic_symbol))
+                    category = all_topics.value(topic_symbol)->attribute("category_name");
+                else
+                    category = "..generic..";
+
+                // Find the category of the named topic (if any).
+                uint pin_char = 0x1f4cc;    // round pin
+                QStaticText cat_pin;
+                cat_pin.setText(QString::fromUcs4(&pin_char, 1));
+                cat_pin.prepare(QTransform(), font);
+                category_pin_of_topic.insert(topic_name, cat_pin);
             }
 
-            // Tell the next bit to read from the buffer
-            in_buffer = true;
-        } /* pins */
-
-        // Do we need to put it in the buffer?
-        if (in_buffer)
-        {
-            buffer.open(QIODevice::WriteOnly);
-            image.save(&buffer, qPrintable(format));
-            buffer.close();
-            in_buffer = true;
+            painter.setPen(QPen(Qt::blue));
+            const QStaticText &pin_text = topic_name.isEmpty() ? default_pin_text : category_pin_of_topic.value(topic_name);
+            painter.drawStaticText(pin->intAttribute("x") / divisor,
+                                   pin->intAttribute("y") / divisor - pin_text.size().height(),
+                                   pin_text);
         }
-    }
+        painter.end();
+
+        // The pins are only for this output, so the image isn't shared with the other writers
+        encodeImage(image, asset);
+    } /* pins */
 
     stream->writeStartElement("img");
     if (!usemap.isEmpty()) stream->writeAttribute("usemap", "#" + usemap);
     stream->writeAttribute("alt", image_name);
-    if (in_buffer)
-        stream->writeAttribute("src", QString("data:image/%1;base64,%2").arg(format)
-                               .arg(QString::fromLatin1(buffer.data().toBase64())));
-    else
-        stream->writeAttribute("src", QString("data:image/%1;base64,%2").arg(format)
-                               .arg(QString::fromLatin1(orig_data.toBase64())));
+    write_data_attribute(stream, "src", "image/" + asset.format, asset.data);
     stream->writeEndElement();  // img
 
     if (!pins.isEmpty())
@@ -722,8 +681,8 @@ static int write_image(QXmlStreamWriter *stream, const QString &image_name, cons
         stream->writeAttribute("name", usemap);
         for (auto pin : pins)
         {
-            int x = pin->attribute("x").toInt() / divisor;
-            int y = pin->attribute("y").toInt() / divisor - pin_size;
+            int x = pin->intAttribute("x") / divisor;
+            int y = pin->intAttribute("y") / divisor - pin_size;
             stream->writeStartElement("area");
             stream->writeAttribute("shape", "rect");
             stream->writeAttribute("coords", QString("%1,%2,%3,%4")
@@ -734,17 +693,17 @@ static int write_image(QXmlStreamWriter *stream, const QString &image_name, cons
             QString pin_name = pin->attribute("pin_name");
             QString description = get_elem_string(pin->xmlChild("description"));
             QString gm_directions = get_elem_string(pin->xmlChild("gm_directions"));
-            QString link = pin->attribute("topic_id");
+            QString link = pin->attribute(XmlElement::KEY_TOPIC_ID);
             // OPTION - use first section of topic if no description or gm_directions is provided
             if (show_full_map_pin_tooltip && (description.isEmpty() || gm_directions.isEmpty()) && !link.isEmpty())
             {
                 // Read topic summary from first section
-                get_summary(link, description, gm_directions);
+                get_summary(all_topics.value(pin->symbolAttribute(XmlElement::KEY_TOPIC_ID)), description, gm_directions);
             }
             QString title = build_tooltip(pin_name, description, gm_directions);
             if (!title.isEmpty()) stream->writeAttribute("title", title);
 
-            if (!link.isEmpty()) write_topic_href(stream, link, false);
+            if (!link.isEmpty()) write_topic_href(stream, link, pin->symbolAttribute(XmlElement::KEY_TOPIC_ID), false);
 
             stream->writeEndElement();  // area
         }
@@ -789,7 +748,7 @@ static void write_ext_object(QXmlStreamWriter *stream, const QString &obj_name,
         stream->writeStartElement("span");
         stream->writeStartElement("a");
         stream->writeAttribute("download", filename);
-        stream->writeAttribute("href", QString("data:%1;base64,%2").arg(mime_type).arg(QString::fromLatin1(data.toBase64())));
+        write_data_attribute(stream, "href", mime_type, data);
         stream->writeCharacters(filename);
         stream->writeEndElement();  // a
         stream->writeEndElement();  // span
@@ -800,7 +759,7 @@ static void write_ext_object(QXmlStreamWriter *stream, const QString &obj_name,
     else
     {
         // Write the asset data to an external file
-        QFile file(filename);
+        OutputFile file(filename);
         if (!file.open(QFile::WriteOnly))
         {
             qWarning() << "writeExtObject: failed to open file for writing:" << filename;
@@ -944,7 +903,7 @@ static void dump_children(const QString &from, const GumboNode *parent)
 }
 #endif
 
-static bool write_html(QXmlStreamWriter *stream, bool use_fixed_title, const QString &sntype, const QByteArray &data)
+static bool render_html(QXmlStreamWriter *stream, bool use_fixed_title, const QString &sntype, const QByteArray &data)
 {
     // Put the children of the BODY into this frame.
     GumboOutput *output = gumbo_parse(data);
@@ -1014,11 +973,88 @@ static bool write_html(QXmlStreamWriter *stream, bool use_fixed_title, const QSt
     return true;
 }
 
+/**
+ * @brief replay_fragment
+ * Writes the elements of a fragment from html_cache through stream,
+ * so that they are indented and encoded in the same way as the rest of the output.
+ * @param stream
+ * @param fragment the XML of the fragment, inside a single wrapper element
+ */
+static void replay_fragment(QXmlStreamWriter *stream, const QByteArray &fragment)
+{
+    QXmlStreamReader reader(fragment);
+    int depth = 0;
+    while (!reader.atEnd())
+    {
+        switch (reader.readNext())
+        {
+        case QXmlStreamReader::StartElement:
+            // Don't copy the wrapper element
+            if (depth++ > 0) stream->writeCurrentToken(reader);
+            break;
+        case QXmlStreamReader::EndElement:
+            if (--depth > 0) stream->writeCurrentToken(reader);
+            break;
+        case QXmlStreamReader::Characters:
+        case QXmlStreamReader::Comment:
+        case QXmlStreamReader::EntityReference:
+            stream->writeCurrentToken(reader);
+            break;
+        default:
+            break;
+        }
+    }
+    if (reader.hasError()) qWarning() << "replay_fragment: invalid cached fragment:" << reader.errorString();
+}
+
+/**
+ * @brief readable_fragment
+ * Checks that the fragment can be read back by replay_fragment.
+ * QXmlStreamWriter will write attribute names which gumbo accepts but which aren't valid XML
+ * (e.g. "@click" or names starting with a digit), and QXmlStreamReader stops at them.
+ */
+static bool readable_fragment(const QByteArray &fragment)
+{
+    QXmlStreamReader reader(fragment);
+    while (!reader.atEnd()) reader.readNext();
+    return !reader.hasError();
+}
+
+/**
+ * @brief write_html
+ * As render_html, but a fragment which has already been converted during this conversion
+ * (e.g. the same statblock in several topics) is copied from html_cache.
+ * A fragment which can't be read back is rendered directly each time (it is cached as an empty array).
+ */
+static bool write_html(QXmlStreamWriter *stream, bool use_fixed_title, const QString &sntype, const QByteArray &data)
+{
+    const QByteArray key = RenderCache<QByteArray>::key(data, sntype + (use_fixed_title ? "|fixed" : "|title"));
+    QByteArray fragment;
+    if (!html_cache.find(key, fragment))
+    {
+        // The fragment is cached as unformatted UTF-8 XML, in a single wrapper element so that it can be read back;
+        // the formatting of the real output is applied when it is replayed.
+        QBuffer buffer(&fragment);
+        buffer.open(QBuffer::WriteOnly);
+        QXmlStreamWriter fragment_stream(&buffer);
+        fragment_stream.setCodec("UTF-8");
+        fragment_stream.writeStartElement("fragment");
+        if (!render_html(&fragment_stream, use_fixed_title, sntype, data)) return false;
+        fragment_stream.writeEndElement();  // fragment
+        buffer.close();
+        if (!readable_fragment(fragment)) fragment.clear();
+        html_cache.insert(key, fragment);
+    }
+    if (fragment.isEmpty()) return render_html(stream, use_fixed_title, sntype, data);
+    replay_fragment(stream, fragment);
+    return true;
+}
+
 
 static void write_snippet(QXmlStreamWriter *stream, XmlElement *snippet, const LinkageList &links)
 {
-    QString sn_type = snippet->attribute("type");
-    QString sn_style = snippet->attribute("style"); // Read_Aloud, Callout, Flavor, Handout
+    QString sn_type = snippet->attribute(XmlElement::KEY_TYPE);
+    QString sn_style = snippet->attribute(XmlElement::KEY_STYLE); // Read_Aloud, Callout, Flavor, Handout
 #if DUMP_LEVEL > 3
     qDebug() << "...snippet" << sn_type;
 #endif
@@ -1056,22 +1092,18 @@ static void write_snippet(QXmlStreamWriter *stream, XmlElement *snippet, const L
                                    filename, sn_style, annotation, links);
 
                     // Put in markers for statblock
-                    QByteArray store = contents->byteData();
-                    QBuffer buffer(&store);
-                    QuaZip zip(&buffer);
-                    if (zip.open(QuaZip::mdUnzip))
+                    const Portfolio portfolio = readPortfolio(contents->byteData());
+                    if (portfolio.valid)
                     {
                         stream->writeStartElement("section");
                         stream->writeAttribute("class", "portfolioListing");
-                        for (bool more=zip.goToFirstFile(); more; more=zip.goToNextFile())
+                        for (const auto &file : portfolio.files)
                         {
-                            if (zip.getCurrentFileName().startsWith("statblocks_html/"))
+                            if (file.name.startsWith("statblocks_html/"))
                             {
-                                QuaZipFile file(&zip);
-                                if (!file.open(QuaZipFile::ReadOnly) ||
-                                        !write_html(stream, false, sn_type, file.readAll()))
+                                if (!write_html(stream, false, sn_type, file.data))
                                 {
-                                    qWarning() << "GUMBO failed to parse" << zip.getCurrentFileName();
+                                    qWarning() << "GUMBO failed to parse" << file.name;
                                 }
                             }
                         }
@@ -1250,16 +1282,16 @@ static void write_topic_body(QXmlStreamWriter *stream, const QString &main_tag,
     // is reported as an alias.
 
 #if DUMP_LEVEL > 1
-    qDebug() << ".topic" << topic->objectName() << ":" << topic->attribute("public_name");
+    qDebug() << ".topic" << topic->objectName() << ":" << topic->attribute(XmlElement::KEY_PUBLIC_NAME);
 #endif
     // Start with HEADER for the topic
     stream->writeStartElement(allinone ? "summary" : "header");
 
     stream->writeAttribute("class", "topicHeader");
-    stream->writeAttribute("id", topic->attribute("topic_id"));
-    if (topic->hasAttribute("prefix")) stream->writeAttribute("topic_prefix", topic->attribute("prefix"));
-    if (topic->hasAttribute("suffix")) stream->writeAttribute("topic_suffix", topic->attribute("suffix"));
-    stream->writeCharacters(topic->attribute("public_name"));
+    stream->writeAttribute("id", topic->attribute(XmlElement::KEY_TOPIC_ID));
+    if (topic->hasAttribute(XmlElement::KEY_PREFIX)) stream->writeAttribute("topic_prefix", topic->attribute(XmlElement::KEY_PREFIX));
+    if (topic->hasAttribute(XmlElement::KEY_SUFFIX)) stream->writeAttribute("topic_suffix", topic->attribute(XmlElement::KEY_SUFFIX));
+    stream->writeCharacters(topic->attribute(XmlElement::KEY_PUBLIC_NAME));
 
     auto aliases = topic->xmlChildren("alias");
     // Maybe some aliases (in own section for smaller font?)
@@ -1294,7 +1326,7 @@ static void write_topic_body(QXmlStreamWriter *stream, const QString &main_tag,
     {
         if (link->attribute("direction") != "Inbound")
         {
-            links.add(link->attribute("target_name"), link->attribute("target_id"));
+            links.add(link->attribute("target_name"), link->attribute("target_id"), link->symbolAttribute("target_id"));
         }
     }
 
@@ -1302,6 +1334,11 @@ static void write_topic_body(QXmlStreamWriter *stream, const QString &main_tag,
     for (auto section: topic->xmlChildren("section"))
     {
         write_section(stream, section, links, /*level*/ 1);
+#ifndef THREADED
+        // Embedded HTML is not needed again, so release the memory
+        // (the threads only read the tree, so they can't release anything).
+        section->releaseTranslations();
+#endif
     }
 
     stream->writeEndElement();  // section (for RW sections)
@@ -1310,7 +1347,7 @@ static void write_topic_body(QXmlStreamWriter *stream, const QString &main_tag,
     auto child_topics = topic->xmlChildren("topic");
     if (!child_topics.isEmpty())
     {
-        std::sort(child_topics.begin(), child_topics.end(), sort_all_topics);
+        topic_sorter.sort(child_topics, sort_by_prefix);
 
         stream->writeStartElement("footer");
         stream->writeAttribute("class", "topicFooter");
@@ -1328,8 +1365,8 @@ static void write_topic_body(QXmlStreamWriter *stream, const QString &main_tag,
             stream->writeAttribute("class", "childTopicsEntry");
 
             stream->writeStartElement("a");
-            write_topic_href(stream, child->attribute("topic_id"));
-            stream->writeCharacters(child->attribute("public_name"));
+            write_topic_href(stream, child->attribute(XmlElement::KEY_TOPIC_ID), child->symbolAttribute(XmlElement::KEY_TOPIC_ID));
+            stream->writeCharacters(child->attribute(XmlElement::KEY_PUBLIC_NAME));
             stream->writeEndElement();   // a
             stream->writeEndElement(); // li
         }
@@ -1365,14 +1402,14 @@ static void write_link(QXmlStreamWriter *stream, const QString &name, const XmlE
     if (topic && topic->objectName() == "topic")
     {
         stream->writeStartElement("a");
-        write_topic_href(stream, topic->attribute("topic_id"));
-        stream->writeCharacters(topic->attribute("public_name"));
+        write_topic_href(stream, topic->attribute(XmlElement::KEY_TOPIC_ID), topic->symbolAttribute(XmlElement::KEY_TOPIC_ID));
+        stream->writeCharacters(topic->attribute(XmlElement::KEY_PUBLIC_NAME));
         stream->writeEndElement();
     }
     else if (!override.isEmpty())
     {
         stream->writeStartElement("a");
-        write_topic_href(stream, override);
+        write_topic_href(stream, override, /*not a topic*/ -1);
         stream->writeCharacters(name);
         stream->writeEndElement();
     }
@@ -1387,11 +1424,11 @@ static void write_link(QXmlStreamWriter *stream, const QString &name, const XmlE
 static void write_topic_file(const XmlElement *topic, const XmlElement *up, const XmlElement *prev, const XmlElement *next)
 {
 #if DUMP_LEVEL > 1
-    qDebug() << ".topic" << topic->objectName() << ":" << topic->attribute("public_name");
+    qDebug() << ".topic" << topic->objectName() << ":" << topic->attribute(XmlElement::KEY_PUBLIC_NAME);
 #endif
 
     // Create a new file for this topic
-    OurFile topic_file(topic->attribute("topic_id") + ".xhtml");
+    OutputFile topic_file(topic->attribute(XmlElement::KEY_TOPIC_ID) + ".xhtml");
     if (!topic_file.open(QFile::WriteOnly|QFile::Text))
     {
         qWarning() << "Failed to open output file for topic" << topic_file.fileName();
@@ -1403,7 +1440,7 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *up, cons
     QXmlStreamWriter *stream = &topic_stream;
 
     start_file(stream);
-    stream->writeTextElement("title", topic->attribute("public_name"));
+    stream->writeTextElement("title", topic->attribute(XmlElement::KEY_PUBLIC_NAME));
     stream->writeEndElement(); // head
 
     stream->writeStartElement("body");
@@ -1461,8 +1498,8 @@ static void write_topic_to_index(QXmlStreamWriter *stream, XmlElement *topic, in
         stream->writeStartElement("summary");
     }
     stream->writeStartElement("a");
-    write_topic_href(stream, topic->attribute("topic_id"));
-    stream->writeCharacters(topic->attribute("public_name"));
+    write_topic_href(stream, topic->attribute(XmlElement::KEY_TOPIC_ID), topic->symbolAttribute(XmlElement::KEY_TOPIC_ID));
+    stream->writeCharacters(topic->attribute(XmlElement::KEY_PUBLIC_NAME));
     stream->writeEndElement();   // a
 
     if (has_kids)
@@ -1473,7 +1510,7 @@ static void write_topic_to_index(QXmlStreamWriter *stream, XmlElement *topic, in
         stream->writeStartElement(QString("ul"));
         stream->writeAttribute("class", QString("summary%1").arg(level));
 
-        std::sort(child_topics.begin(), child_topics.end(), sort_all_topics);
+        topic_sorter.sort(child_topics, sort_by_prefix);
 
         for (auto child_topic: child_topics)
         {
@@ -1490,7 +1527,7 @@ static void write_topic_to_index(QXmlStreamWriter *stream, XmlElement *topic, in
 
 static void write_separate_index(const XmlElement *root_elem)
 {
-    QFile out_file("index.xhtml");
+    OutputFile out_file("index.xhtml");
     if (!out_file.open(QFile::WriteOnly|QFile::Text))
     {
         qWarning() << "Failed to find file" << out_file.fileName();
@@ -1585,7 +1622,7 @@ static void write_separate_index(const XmlElement *root_elem)
 
                     // Organise topics alphabetically
                     auto topics = categories.values(cat);
-                    std::sort(topics.begin(), topics.end(), sort_all_topics);
+                    topic_sorter.sort(topics, sort_by_prefix);
 
                     for (auto topic: topics)
                     {
@@ -1716,6 +1753,116 @@ static void write_child_topics(XmlElement *parent)
 }
 
 
+/**
+ * @brief estimate_size
+ * A rough estimate of the number of bytes that will be written for a topic and all its descendents
+ * (most of which is BASE64 encoded binary data).
+ * @param topic
+ * @return
+ */
+static qint64 estimate_size(const XmlElement *topic)
+{
+    qint64 size = topic->dataSize();
+    for (const XmlElement *child : topic->findChildren<XmlElement*>())
+        size += child->dataSize();
+    return size * 4 / 3;
+}
+
+
+/**
+ * @brief assign_volumes
+ * Splits the top-level topics of a single file into volumes of (roughly) max_size bytes,
+ * so that the links between volumes are known before any volume is written.
+ * Each child topic is in the same volume as its top-level topic.
+ * @param topics the top-level topics, in the order that they will be written
+ * @param max_size 0 if everything is to be put into a single volume
+ * @return the volume number (starting from 1) of each of the topics
+ */
+static QVector<int> assign_volumes(const QList<XmlElement*> &topics, qint64 max_size)
+{
+    QVector<int> result;
+    result.reserve(topics.size());
+    topic_volume.clear();
+    int volume = 1;
+    qint64 volume_size = 0;
+    for (auto topic : topics)
+    {
+        // A topic is never split, so one large topic can make its volume larger than max_size
+        const qint64 size = (max_size > 0) ? estimate_size(topic) : 0;
+        if (volume_size > 0 && volume_size + size > max_size)
+        {
+            volume++;
+            volume_size = 0;
+        }
+        volume_size += size;
+        result.append(volume);
+        topic_volume.insert(topic->symbolAttribute(XmlElement::KEY_TOPIC_ID), volume);
+        for (auto child : topic->findChildren<XmlElement*>("topic"))
+            topic_volume.insert(child->symbolAttribute(XmlElement::KEY_TOPIC_ID), volume);
+    }
+    return result;
+}
+
+
+/**
+ * @brief volume_filename
+ * @param path the name chosen for the single file
+ * @param volume
+ * @return the name of the file for one volume, e.g. campaign-2.xhtml
+ */
+static QString volume_filename(const QString &path, int volume)
+{
+    const QFileInfo info(path);
+    return info.dir().filePath(QString("%1-%2.%3").arg(info.completeBaseName()).arg(volume).arg(info.suffix()));
+}
+
+
+/**
+ * @brief write_volume_links
+ * Writes links to every volume of a single file which has been split.
+ * @param stream
+ */
+static void write_volume_links(QXmlStreamWriter *stream)
+{
+    stream->writeStartElement("nav");
+    stream->writeAttribute("class", "volumes");
+    for (int volume = 1; volume <= volume_files.size(); volume++)
+    {
+        const QString label = QString("Volume %1").arg(volume);
+        if (volume > 1) stream->writeCharacters(" | ");
+        if (volume == current_volume)
+            stream->writeTextElement("b", label);
+        else
+        {
+            stream->writeStartElement("a");
+            stream->writeAttribute("href", volume_files.at(volume-1));
+            stream->writeCharacters(label);
+            stream->writeEndElement();  // a
+        }
+    }
+    stream->writeEndElement();  // nav
+}
+
+
+/**
+ * @brief collect_styles
+ * Adds the STYLE attribute of every element in this part of the tree to styles.
+ * xmlChildren is used so that the styles within any embedded HTML are found,
+ * but the translated HTML of each section is released again once it has been scanned
+ * (it is translated again when the section is written).
+ */
+static void collect_styles(XmlElement *elem, QSet<QString> &styles)
+{
+    if (elem->hasAttribute(XmlElement::KEY_STYLE))
+    {
+        styles.insert(elem->attribute(XmlElement::KEY_STYLE));
+    }
+    for (auto child : elem->xmlChildren())
+        collect_styles(child, styles);
+    if (elem->objectName() == "section") elem->releaseTranslations();
+}
+
+
 /**
  * @brief toHtml
  * Generate HTML 5 (XHTML) representation of the supplied XmlElement tree
@@ -1725,13 +1872,16 @@ static void write_child_topics(XmlElement *parent)
  * @param separate_files
  * @param use_reveal_mask
  * @param index_on_every_page
+ * @param max_volume_size if non-zero, a single file is split into several volumes of about this many bytes
+ * @return the number of files which could not be written
  */
-void toHtml(const QString &path,
-            const XmlElement *root_elem,
-            int max_image_width,
-            bool separate_files,
-            bool use_reveal_mask,
-            bool index_on_every_page)
+int toHtml(const QString &path,
+           const XmlElement *root_elem,
+           int max_image_width,
+           bool separate_files,
+           bool use_reveal_mask,
+           bool index_on_every_page,
+           qint64 max_volume_size)
 {
 #ifdef TIME_CONVERSION
     QElapsedTimer timer;
@@ -1742,18 +1892,16 @@ void toHtml(const QString &path,
     apply_reveal_mask = use_reveal_mask;
     always_show_index = index_on_every_page;
     in_single_file    = !separate_files;
-    collator.setNumericMode(true);
+    topic_sorter.clear();
+    topic_sorter.addTopics(root_elem->findChildren<XmlElement*>("topic"));
+    html_cache.clear();
+    preparePortfolios(root_elem);
 
     // Get a full list of the individual STYLE attributes of every single topic,
     // with a view to putting them into the CSS instead.
     QSet<QString> styles_set;
-    for (auto child : root_elem->findChildren<XmlElement*>())
-    {
-        if (child->hasAttribute("style"))
-        {
-            styles_set.insert(child->attribute("style"));
-        }
-    }
+    for (auto child : root_elem->xmlChildren())
+        collect_styles(child, styles_set);
     class_of_style.clear();
     int stylenumber=1;
     for (auto style: styles_set)
@@ -1767,11 +1915,15 @@ void toHtml(const QString &path,
 
     // To help get category for pins on each individual topic,
     // get the topic_id of every single topic in the file.
+    all_topics.clear();
     for (auto topic: root_elem->findChildren<XmlElement*>("topic"))
     {
-        all_topics.insert(topic->attribute("topic_id"), topic);
+        all_topics.insert(topic->symbolAttribute(XmlElement::KEY_TOPIC_ID), topic);
     }
 
+    // Volumes of the single file which couldn't be opened (the other files are counted by waitForOutputFiles)
+    int failed_volumes = 0;
+
     // Write out the individual TOPIC files now:
     // Note use of findChildren to find children at all levels,
     // whereas xmlChildren returns only direct children.
@@ -1782,6 +1934,8 @@ void toHtml(const QString &path,
 
         // A separate file for every single topic
 #ifdef THREADED
+        // The embedded HTML must be translated before the threads read the tree
+        root_elem->translateAll();
         auto topics = root_elem->findChildren<XmlElement*>("topic");
         // This method speeds up the output of multiple files by creating separate
         // threads to handle each CHUNK of topics.
@@ -1822,51 +1976,79 @@ void toHtml(const QString &path,
             qDebug() << "definition =" << definition;
             qDebug() << "contents   =" << contents;
             qDebug() << "details    =" << details;
-            return;
+            return waitForOutputFiles();
         }
 
-        // Write header for single file
-        // Create a new file for this topic
-        OurFile single_file(path);
-        if (!single_file.open(QFile::WriteOnly|QFile::Text))
+        // All topics in a single file, grouped by category,
+        // nesting child topics inside the parent topic.
+        auto children = contents->xmlChildren("topic");
+        topic_sorter.sort(children, sort_by_prefix);
+
+        // The single file might be split into several volumes.
+        const QVector<int> volume_of = assign_volumes(children, max_volume_size);
+        const int volumes = volume_of.isEmpty() ? 1 : volume_of.last();
+        volume_files.clear();
+        if (volumes > 1)
         {
-            qWarning() << "Failed to open chosen output file" << single_file.fileName();
-            return;
+            for (int volume = 1; volume <= volumes; volume++)
+                volume_files.append(QFileInfo(volume_filename(path, volume)).fileName());
         }
 
-        // Switch output to the new stream.
-        QXmlStreamWriter stream(&single_file);
+        int next_topic = 0;
+        for (current_volume = 1; current_volume <= volumes; current_volume++)
+        {
+            // Write header for single file
+            OurFile single_file(volumes > 1 ? volume_filename(path, current_volume) : path);
+            if (!single_file.open(QFile::WriteOnly|QFile::Text))
+            {
+                qWarning() << "Failed to open chosen output file" << single_file.fileName();
+                // This volume, and the ones after it, won't be written
+                failed_volumes = volumes - current_volume + 1;
+                break;
+            }
 
-        start_file(&stream);
-        stream.writeTextElement("title", details->attribute("name"));
-        write_head_meta(&stream, root_elem);
-        stream.writeEndElement(); // head
+            // Switch output to the new stream.
+            QXmlStreamWriter stream(&single_file);
 
-        stream.writeStartElement("body");
+            start_file(&stream);
+            QString title = details->attribute("name");
+            if (volumes > 1) title += QString(" (%1 of %2)").arg(current_volume).arg(volumes);
+            stream.writeTextElement("title", title);
+            write_head_meta(&stream, root_elem);
+            stream.writeEndElement(); // head
 
-        write_first_page(&stream, root_elem);
+            stream.writeStartElement("body");
 
-        // All topics in a single file, grouped by category,
-        // nesting child topics inside the parent topic.
-        auto children = contents->xmlChildren("topic");
-        std::sort(children.begin(), children.end(), sort_all_topics);
+            if (current_volume == 1) write_first_page(&stream, root_elem);
+            if (volumes > 1) write_volume_links(&stream);
 
-        for (auto topic : children)
-        {
-            stream.writeStartElement("details");
-            stream.writeAttribute("class", "mainTopic");
-            stream.writeAttribute("open", "open");
-            write_topic_body(&stream, "summary", topic, /*allinone*/ true);
-            stream.writeEndElement();  // details
-        }
+            for (; next_topic < children.size() && volume_of.at(next_topic) == current_volume; next_topic++)
+            {
+                stream.writeStartElement("details");
+                stream.writeAttribute("class", "mainTopic");
+                stream.writeAttribute("open", "open");
+                write_topic_body(&stream, "summary", children.at(next_topic), /*allinone*/ true);
+                stream.writeEndElement();  // details
+            }
 
-        // Write footer for single file
-        // Complete the individual topic file
-        stream.writeEndElement(); // body
-        stream.writeEndElement(); // html
+            // Write footer for single file
+            // Complete the individual topic file
+            stream.writeEndElement(); // body
+            stream.writeEndElement(); // html
+        }
+        current_volume = 0;
+        volume_files.clear();
+        topic_volume.clear();
     }
 
+    // Make sure everything is on the disk before reporting completion.
+    const int failed_files = waitForOutputFiles() + failed_volumes;
+
 #ifdef TIME_CONVERSION
     qInfo() << "TIME TO GENERATE HTML =" << timer.elapsed() << "milliseconds";
+    qInfo() << "EMBEDDED HTML: converted" << html_cache.misses() << "fragments, reused" << html_cache.hits();
 #endif
+    html_cache.clear();
+    clearPortfolios();
+    return failed_files;
 }
@@ -30,11 +30,12 @@ extern QString map_pin_description;
 extern QString map_pin_gm_directions;
 
 
-void toHtml(const QString &path,
-            const XmlElement *root_elem,
-            int max_image_width,
-            bool separate_files,
-            bool use_reveal_mask,
-            bool index_on_every_page);
+int toHtml(const QString &path,
+           const XmlElement *root_elem,
+           int max_image_width,
+           bool separate_files,
+           bool use_reveal_mask,
+           bool index_on_every_page,
+           qint64 max_volume_size = 0);
 
 #endif // OUTPUTHTML_H
@@ -38,21 +38,24 @@
 #include <future>
 #include <QDateTime>
 #include <QRegularExpression>
-#ifdef TIME_CONVERSION
+#if defined(TIME_CONVERSION) || defined(BENCHMARK_DICE)
 #include <QElapsedTimer>
 #endif
 
 #include "gumbo.h"
-#include <quazip/quazip.h>
-#include <quazip/quazipfile.h>
 
 #include "xmlelement.h"
+#include "imageasset.h"
 #include "linefile.h"
+#include "outputfile.h"
 #include "linkage.h"
+#include "portfolio.h"
+#include "rendercache.h"
+#include "symboltable.h"
+#include "topicsorter.h"
 
 static bool apply_reveal_mask = true;
 static bool sort_by_prefix = true;
-static QCollator collator;              // allow alphanumeric sorting to do proper number comparisons
 static bool category_folders = true;
 static bool use_wikilinks = false;
 static bool show_leaflet_pins = true;
@@ -83,6 +86,22 @@ static QHash<QString,QString> topic_filename;               // key=topic_id/plot
 static QHash<const XmlElement*,QString> topic_full_name;    // key=topic_id, value=<prefix+public_name+suffix>
 static QHash<QString,QString> tag_full_name;                // key=tag_id, value=name attribute of <domain> or <domain_global>
 
+/**
+ * @brief The LinkTarget struct
+ * The various forms of reference to a single topic (or plot, or index page),
+ * built once per export so that they don't need to be recreated every time a link is written.
+ */
+struct LinkTarget
+{
+    QString dirname;        // folder holding this topic's file
+    QString child_dirname;  // folder holding the files of the children of this topic
+    QString link;           // link labelled with the full name
+    QString bare_link;      // link without an explicit label
+    QString nav_link;       // link with vertical bars escaped for use in a table
+    QString mermaid;        // node for a mermaid graph
+};
+static QHash<QString,LinkTarget> link_targets;              // key=topic_id/plot_id
+
 extern QString map_pin_title;
 extern QString map_pin_description;
 extern QString map_pin_gm_directions;
@@ -101,7 +120,7 @@ static const QString YAMLLIST("  - ");
 
 static QString mainPageName;
 static QString imported_date;
-static QMap<QString,QString> global_names;      // key=<any *_id>, value=<"name of key_id">  - tag, facet, category, partition, topic, plot
+static SymbolTable<QString> global_names;       // key=<any *_id>, value=<"name of key_id">  - tag, facet, category, partition, topic, plot
 #define DUMP_LEVEL 0
 
 
@@ -168,7 +187,7 @@ static const QString snippetLabel(const XmlElement *elem)
     result = elem->attribute("facet_name");
     if (!result.isEmpty()) return result;
 
-    return global_names.value(elem->attribute("facet_id"));
+    return global_names.value(elem->symbolAttribute("facet_id"));
 }
 
 
@@ -197,49 +216,47 @@ static inline const QString validTag(const QString &string)
 }
 
 
-static const QString dirFile(const QString &dirname, const QString &filename)
+static QSet<QString> existing_dirs;     // directories known to exist during this export
+
+/**
+ * @brief make_directory
+ * Ensures that the directory exists, remembering it so that the file system only needs to be checked once per export.
+ * @param dirname relative to the current directory
+ * @return true if the directory exists
+ */
+static bool make_directory(const QString &dirname)
 {
-    // Each component of dirname must already have been processed by validFilename
-    QDir dir(dirname);
-    if (!dir.exists()) {
+    if (existing_dirs.contains(dirname)) return true;
+    if (!QDir(dirname).exists())
+    {
         //qDebug() << "Creating directory: " << dirname;
-        if (!QDir::current().mkpath(dirname)) {
+        if (!QDir::current().mkpath(dirname))
+        {
             qWarning() << "Failed to create directory: " << dirname;
-            // Store at the top level instead
-            return filename;
+            return false;
         }
     }
-    return dirname + QDir::separator() + validFilename(filename);
+    existing_dirs.insert(dirname);
+    return true;
 }
 
 
-static const QString parentDirName(const XmlElement *topic)
+static const QString dirFile(const QString &dirname, const QString &filename)
 {
-    XmlElement *parent = topic->parent();
-    if (parent && parent->objectName() == "topic")
-        return parentDirName(parent) + QDir::separator() + topic_filename.value(parent->attribute("topic_id"));
-    else
-        return validFilename(global_names.value(topic->attribute("category_id")));
+    // Each component of dirname must already have been processed by validFilename
+    if (!make_directory(dirname))
+    {
+        // Store at the top level instead
+        return filename;
+    }
+    return dirname + QDir::separator() + validFilename(filename);
 }
 
 
 static const QString topicDirFile(const XmlElement *topic)
 {
-    // If the topic has children, then create a folder named after this note,
-    // and put the note in it.
-    // This is a parent topic, so create a folder to hold it.
-    const QString filename = topic_filename.value(topic->attribute("topic_id"));
-    if (category_folders)
-    {
-        return dirFile(validFilename(global_names.value(topic->attribute("category_id"))), filename) + ".md";
-    }
-    else
-    {
-        QString dirname = parentDirName(topic);
-        if (topic->xmlChild("topic"))       // has at least one child
-            dirname += QDir::separator() + filename;
-        return dirFile(dirname, filename) + ".md";
-    }
+    const QString topic_id = topic->attribute(XmlElement::KEY_TOPIC_ID);
+    return dirFile(link_targets.value(topic_id).dirname, topic_filename.value(topic_id)) + ".md";
 }
 
 
@@ -272,36 +289,13 @@ static inline const QString mermaid_node_raw(const QString &name, const QString
 
 static inline const QString mermaid_node(const QString &topic_id)
 {
+    auto target = link_targets.constFind(topic_id);
+    if (target != link_targets.constEnd()) return target->mermaid;
     return mermaid_node_raw(topic_id, topic_filename.value(topic_id));
 }
 
 
-// Sort topics, first by prefix, and then by topic name
-static bool sort_topics(const XmlElement *left, const XmlElement *right)
-{
-    if (sort_by_prefix)
-    {
-        // items with prefix come before items without prefix
-        const QString &left_prefix  = left->attribute("prefix");
-        const QString &right_prefix = right->attribute("prefix");
-        if (left_prefix != right_prefix)
-        {
-            if (right_prefix.isEmpty())
-            {
-                // left prefix is not empty, so must come first
-                return true;
-            }
-            if (left_prefix.isEmpty())
-            {
-                // right prefix is not empty, so must come first
-                return false;
-            }
-            return collator.compare(left_prefix, right_prefix) < 0;
-        }
-    }
-    // Both have the same prefix
-    return collator.compare(topic_full_name.value(left), topic_full_name.value(right)) < 0;
-}
+static TopicSorter topic_sorter([](const XmlElement *topic) { return topic_full_name.value(topic); });
 
 
 /**
@@ -386,12 +380,12 @@ static QString template_partition(int level, const XmlElement *partition)
         if (elem == "facet_global" || elem == "facet")
         {
             QString name = child->attribute("name");
-            QString fctype = child->attribute("type");
+            QString fctype = child->attribute(XmlElement::KEY_TYPE);
             if (fctype == "Hybrid_Tag" || fctype == "Tag_Standard")
             {
-                QString tagname = validTag(global_names.value(child->attribute("domain_id")));
+                QString tagname = validTag(global_names.value(child->symbolAttribute("domain_id")));
                 QString tag_id   = child->attribute("tag_id");  // only with Hybrid_Tag
-                if (!tag_id.isEmpty()) tagname.append('/' + validTag(global_names.value(tag_id)));
+                if (!tag_id.isEmpty()) tagname.append('/' + validTag(global_names.value(child->symbolAttribute("tag_id"))));
 
                 //QString is_lock  = child->attribute("is_lock_domain");
                 //QString is_multi = child->attribute("is_multi_tag");
@@ -481,7 +475,7 @@ static QString template_partition(int level, const XmlElement *partition)
 
 static void write_template(const XmlElement *category)
 {
-    QFile outfile(dirFile(templatesDir, validFilename(category->attribute("name"))) + ".md");
+    OutputFile outfile(dirFile(templatesDir, validFilename(category->attribute("name"))) + ".md");
     if (!outfile.open(QFile::WriteOnly))
     {
         qWarning() << "Failed to create template file for category" << category->attribute("name");
@@ -643,6 +637,11 @@ static inline QString createLink(const QString &filename, const QString &label,
 
 static inline QString internal_link(const QString &topic_id, const QString &label = QString(), int max_width=-1)
 {
+    if (label.isEmpty() && max_width <= 0)
+    {
+        auto target = link_targets.constFind(topic_id);
+        if (target != link_targets.constEnd()) return target->bare_link;
+    }
     QString filename = topic_filename.value(topic_id);
     if (filename.isEmpty()) filename = validFilename(topic_id);
     return createLink(filename, label, max_width);
@@ -651,7 +650,68 @@ static inline QString internal_link(const QString &topic_id, const QString &labe
 
 static inline QString topic_link(const XmlElement *topic)
 {
-    return internal_link(topic->attribute("topic_id"), topic_full_name.value(topic));
+    auto target = link_targets.constFind(topic->attribute(XmlElement::KEY_TOPIC_ID));
+    if (target != link_targets.constEnd()) return target->link;
+    return internal_link(topic->attribute(XmlElement::KEY_TOPIC_ID), topic_full_name.value(topic));
+}
+
+
+/**
+ * @brief add_link_target
+ * Records all the forms of link to the topic/plot with the given ID,
+ * which must already have an entry in topic_filename.
+ * @param id
+ * @param label the text to display in the link
+ * @param dirname the folder which contains the file for this ID
+ * @param child_dirname the folder which contains the files for the children of this ID
+ */
+static LinkTarget &add_link_target(const QString &id, const QString &label,
+                                   const QString &dirname = QString(), const QString &child_dirname = QString())
+{
+    const QString filename = topic_filename.value(id);
+    LinkTarget &target = link_targets[id];
+    target.dirname       = dirname;
+    target.child_dirname = child_dirname;
+    target.link          = createLink(filename, label);
+    target.bare_link     = createLink(filename, QString());
+    target.nav_link      = QString(target.link).replace("|","\\|");
+    target.mermaid       = mermaid_node_raw(id, filename);
+    return target;
+}
+
+
+/**
+ * @brief build_link_targets
+ * Creates the LinkTarget for every topic in the export.
+ * findChildren returns each parent topic before any of its children,
+ * so the folder of the parent is always available when its children are processed.
+ * @param topics
+ */
+static void build_link_targets(const QList<XmlElement*> &topics)
+{
+    link_targets.reserve(link_targets.size() + topics.size());
+    for (const auto topic : topics)
+    {
+        const QString topic_id = topic->attribute(XmlElement::KEY_TOPIC_ID);
+        const QString category_dir = validFilename(global_names.value(topic->symbolAttribute(XmlElement::KEY_CATEGORY_ID)));
+        QString dirname;
+        if (category_folders)
+            dirname = category_dir;
+        else
+        {
+            XmlElement *parent = topic->parent();
+            if (parent && parent->objectName() == "topic")
+                dirname = link_targets.value(parent->attribute(XmlElement::KEY_TOPIC_ID)).child_dirname;
+            else
+                dirname = category_dir;
+        }
+        // If the topic has children, then create a folder named after this note,
+        // and put the note (and its children) in it.
+        const QString child_dirname = dirname + QDir::separator() + topic_filename.value(topic_id);
+        if (!category_folders && topic->xmlChild("topic"))       // has at least one child
+            dirname = child_dirname;
+        add_link_target(topic_id, topic_full_name.value(topic), dirname, child_dirname);
+    }
 }
 
 
@@ -684,147 +744,70 @@ static inline const QString getGumboAttribute(const GumboNode *node, const QStri
  */
 struct TextStyle {
 private:
-    bool is_empty=true;
-    bool bold=false;
-    bool italic=false;
-    bool strikethru=false;
-    bool underline=false;
-    bool superscript=false;
-    bool subscript=false;
+    // Each enhancement is one bit, so combining and comparing styles is simple bit arithmetic.
+    enum Flag : quint8 {
+        Bold        = 0x01,
+        Italic      = 0x02,
+        Strikethru  = 0x04,
+        Underline   = 0x08,
+        Superscript = 0x10,
+        Subscript   = 0x20
+    };
+    quint8 flags=0;
 
-    void clear()
-    {
-        bold=false;
-        italic=false;
-        strikethru=false;
-        underline=false;
-        superscript=false;
-        subscript=false;
-        is_empty=true;
-    }
+    explicit TextStyle(quint8 flags) : flags(flags) {}
+    inline bool has(Flag flag) const { return (flags & flag) != 0; }
 
 public:
     TextStyle() {};
     static const TextStyle NULL_STYLE;
 
-    static TextStyle fromStyle(const QString &details)
-    {
-        TextStyle result;
-        result.decodeStyle(details);
-        return result;
-    }
+    static TextStyle fromStyle(const QString &details);
     static TextStyle fromNode(const QString &nodename)
     {
-        TextStyle result;
         if (nodename == "sup")
-        {
-            result.superscript = true;
-            result.is_empty    = false;
-        }
+            return TextStyle(Superscript);
         else if (nodename == "sub")
-        {
-            result.subscript = true;
-            result.is_empty  = false;
-        }
+            return TextStyle(Subscript);
         else if (nodename == "b")
-        {
-            result.bold     = true;
-            result.is_empty = false;
-        }
+            return TextStyle(Bold);
         else if (nodename == "i")
-        {
-            result.italic   = true;
-            result.is_empty = false;
-        }
-        return result;
-    }
-    bool operator==(const TextStyle &other)
-    {
-        return bold==other.bold &&
-                italic==other.italic &&
-                subscript==other.subscript &&
-                superscript==other.superscript &&
-                underline==other.underline &&
-                strikethru==other.strikethru;
-    }
-    TextStyle operator+(const TextStyle &other) const
-    {
-        TextStyle result = *this;
-        if (other.bold)        result.bold        = true;
-        if (other.italic)      result.italic      = true;
-        if (other.subscript)   result.subscript   = true;
-        if (other.superscript) result.superscript = true;
-        if (other.underline)   result.underline   = true;
-        if (other.strikethru)  result.strikethru  = true;
-        result.setIsEmpty();
-        return result;
-    }
-    TextStyle &operator+=(const TextStyle &other)
-    {
-        if (other.bold)        bold        = true;
-        if (other.italic)      italic      = true;
-        if (other.subscript)   subscript   = true;
-        if (other.superscript) superscript = true;
-        if (other.underline)   underline   = true;
-        if (other.strikethru)  strikethru  = true;
-        setIsEmpty();
-        return *this;
-    }
-    TextStyle operator-(const TextStyle &other) const
-    {
-        TextStyle result = *this;
-        if (other.bold)        result.bold        = false;
-        if (other.italic)      result.italic      = false;
-        if (other.subscript)   result.subscript   = false;
-        if (other.superscript) result.superscript = false;
-        if (other.underline)   result.underline   = false;
-        if (other.strikethru)  result.strikethru  = false;
-        result.setIsEmpty();
-        return result;
-    }
-    TextStyle &operator-=(const TextStyle &other)
-    {
-        if (other.bold)        bold        = false;
-        if (other.italic)      italic      = false;
-        if (other.subscript)   subscript   = false;
-        if (other.superscript) superscript = false;
-        if (other.underline)   underline   = false;
-        if (other.strikethru)  strikethru  = false;
-        setIsEmpty();
-        return *this;
+            return TextStyle(Italic);
+        return TextStyle();
     }
+    bool operator==(const TextStyle &other) const { return flags == other.flags; }
+    TextStyle operator+(const TextStyle &other) const { return TextStyle(flags | other.flags); }
+    TextStyle &operator+=(const TextStyle &other) { flags |= other.flags; return *this; }
+    TextStyle operator-(const TextStyle &other) const { return TextStyle(flags & ~other.flags); }
+    TextStyle &operator-=(const TextStyle &other) { flags &= ~other.flags; return *this; }
     const QString toString() const
     {
         QStringList result;
-        if (bold)        result.append("bold");
-        if (italic)      result.append("italic");
-        if (strikethru)  result.append("strikethrough");
-        if (underline)   result.append("underline");
-        if (superscript) result.append("superscript");
-        if (subscript)   result.append("subscript");
+        if (has(Bold))        result.append("bold");
+        if (has(Italic))      result.append("italic");
+        if (has(Strikethru))  result.append("strikethrough");
+        if (has(Underline))   result.append("underline");
+        if (has(Superscript)) result.append("superscript");
+        if (has(Subscript))   result.append("subscript");
         return result.join(",");
     };
-    bool isEmpty() const { return is_empty; };
+    bool isEmpty() const { return flags == 0; };
 
 private:
-    void setIsEmpty()
-    {
-        is_empty = !(bold || italic || strikethru || underline || superscript || subscript);
-    }
     void decodeStyle(const QString &style)
     {
         // It could be a NODE name rather than a style
         if (style == "sup")
         {
-            superscript = true;
+            flags |= Superscript;
             return;
         }
         else if (style == "sub")
         {
-            subscript = true;
+            flags |= Subscript;
             return;
         }
-        foreach (const auto &part, style.split(";"))
+        foreach (const auto &part, style.splitRef(";"))
         {
             const auto bits = part.split(":");
             if (bits.length() != 2) continue;
@@ -834,7 +817,7 @@ private:
             {
                 foreach (const auto &value, values)
                 {
-                    if (value == "bold") bold = true;
+                    if (value == "bold") flags |= Bold;
                     //else qWarning() << "Unknown element in font-weight: " << value;
                 }
             }
@@ -843,7 +826,7 @@ private:
                 // normal|italic|oblique|initial|inherit
                 foreach (const auto &value, values)
                 {
-                    if (value == "italic") italic = true;
+                    if (value == "italic") flags |= Italic;
                     //else qWarning() << "Unknown element in font-style: " << value;
                 }
             }
@@ -852,8 +835,8 @@ private:
                 // solid|double|dotted|dashed|wavy|initial|inherit
                 foreach (const auto &value, values)
                 {
-                    if      (value == "line-through") strikethru = true;
-                    else if (value == "underline")    underline  = true;
+                    if      (value == "line-through") flags |= Strikethru;
+                    else if (value == "underline")    flags |= Underline;
                     //else if (value == "none") ;
                     //else qWarning() << "Unknown element in text-decoration: " << value;
                 }
@@ -866,13 +849,27 @@ private:
                 ; //qWarning() << "Unknown element of style: " << bits.first();
             }
         }
-        setIsEmpty();
     };
     friend class TextStyleManager;
 };
 const TextStyle TextStyle::NULL_STYLE;
 
+// The same few style strings are used by most of the spans in a realm, so each is only decoded once.
+static QHash<QString,TextStyle> decoded_styles;
+
+TextStyle TextStyle::fromStyle(const QString &details)
+{
+    auto it = decoded_styles.constFind(details);
+    if (it != decoded_styles.constEnd()) return it.value();
+    TextStyle result;
+    result.decodeStyle(details);
+    decoded_styles.insert(details, result);
+    return result;
+}
+
 typedef QHash<QString,TextStyle> GumboStyles;
+static QHash<QByteArray,GumboStyles> decoded_style_sheets;    // key=contents of <style> element
+static RenderCache<QString> html_cache;     // embedded HTML already converted during this export
 
 
 class TextStyleManager
@@ -882,6 +879,18 @@ public:
     {
         return this->current;
     }
+    /**
+     * @brief setFloor
+     * The styling markers are only adjusted after position @floor in the output,
+     * so that text written earlier by a caller is never merged into the current change.
+     * @param floor
+     * @return the previous floor
+     */
+    int setFloor(int floor)
+    {
+        std::swap(this->floor, floor);
+        return floor;
+    }
     /**
      * @brief start
      * Put into @result all the markers required to define the styles given in @style
@@ -913,31 +922,31 @@ public:
         if (current==tostyle) return;
 
         // Remove any elements no longer required
-        if (!current.is_empty)
+        if (!current.isEmpty())
         {
             // Which things to switch off
             // Ensure space (if any) is AFTER the close
-            bool space = result.endsWith(' ');
+            bool space = result.length() > floor && result.endsWith(' ');
             if (space) result.truncate(result.length()-1);
-            removeFlag(result, current.subscript,   tostyle.subscript,   "</sub>", "<sub>");
-            removeFlag(result, current.superscript, tostyle.superscript, "</sup>", "<sup>");
-            removeFlag(result, current.underline,   tostyle.underline,   "</u>",   "<u>");
-            removeFlag(result, current.strikethru,  tostyle.strikethru,  "~~",     "~~");
-            removeFlag(result, current.bold,        tostyle.bold,        "**",     "**",   false);
-            removeFlag(result, current.italic,      tostyle.italic,      "*",      "*",    false);
+            removeFlag(result, current.has(TextStyle::Subscript),   tostyle.has(TextStyle::Subscript),   "</sub>", "<sub>");
+            removeFlag(result, current.has(TextStyle::Superscript), tostyle.has(TextStyle::Superscript), "</sup>", "<sup>");
+            removeFlag(result, current.has(TextStyle::Underline),   tostyle.has(TextStyle::Underline),   "</u>",   "<u>");
+            removeFlag(result, current.has(TextStyle::Strikethru),  tostyle.has(TextStyle::Strikethru),  "~~",     "~~");
+            removeFlag(result, current.has(TextStyle::Bold),        tostyle.has(TextStyle::Bold),        "**",     "**",   false);
+            removeFlag(result, current.has(TextStyle::Italic),      tostyle.has(TextStyle::Italic),      "*",      "*",    false);
             if (space) result += ' ';
         }
         // Add any elements not currently present
-        if (!tostyle.is_empty)
+        if (!tostyle.isEmpty())
         {
             // Which things to switch on (opposite order to OFF)
             // Only set flag in current if switching on
-            addFlag(result, current.italic,      tostyle.italic,      "*");
-            addFlag(result, current.bold,        tostyle.bold,        "**");
-            addFlag(result, current.strikethru,  tostyle.strikethru,  "~~");
-            addFlag(result, current.underline,   tostyle.underline,   "<u>");
-            addFlag(result, current.superscript, tostyle.superscript, "<sup>");
-            addFlag(result, current.subscript,   tostyle.subscript,   "<sub>");
+            addFlag(result, current.has(TextStyle::Italic),      tostyle.has(TextStyle::Italic),      "*");
+            addFlag(result, current.has(TextStyle::Bold),        tostyle.has(TextStyle::Bold),        "**");
+            addFlag(result, current.has(TextStyle::Strikethru),  tostyle.has(TextStyle::Strikethru),  "~~");
+            addFlag(result, current.has(TextStyle::Underline),   tostyle.has(TextStyle::Underline),   "<u>");
+            addFlag(result, current.has(TextStyle::Superscript), tostyle.has(TextStyle::Superscript), "<sup>");
+            addFlag(result, current.has(TextStyle::Subscript),   tostyle.has(TextStyle::Subscript),   "<sub>");
         }
 
         // Remember the current style
@@ -946,20 +955,21 @@ public:
 
 private:
     TextStyle current;
+    int floor{0};
 
-    inline void addFlag(QString &result, const bool &from, const bool &to, const QString &starttag)
+    inline void addFlag(QString &result, bool from, bool to, const QString &starttag)
     {
         if (!from && to)
         {
             result += starttag;
         }
     }
-    inline void removeFlag(QString &result, const bool &from, const bool &to, const QString &endtag, const QString &starttag, const bool optimise=true) const
+    inline void removeFlag(QString &result, bool from, bool to, const QString &endtag, const QString &starttag, const bool optimise=true) const
     {
         if (from && !to)
         {
             // Doesn't cancel bold+italic properly
-            if (optimise && result.endsWith(starttag))
+            if (optimise && result.length() - floor >= starttag.length() && result.endsWith(starttag))
                 // There is no text between the start and end of this formatting, so remove the START indicator
                 result.truncate(result.length() - starttag.length());
             else
@@ -969,6 +979,15 @@ private:
 };
 
 
+static inline void add_styles(GumboStyles &result, const GumboStyles &styles)
+{
+    if (result.isEmpty())
+        result = styles;
+    else
+        for (auto it = styles.constBegin(); it != styles.constEnd(); ++it) result.insert(it.key(), it.value());
+}
+
+
 GumboStyles getStyles(const GumboNode *node)
 {
     GumboStyles result;
@@ -982,6 +1001,16 @@ GumboStyles getStyles(const GumboNode *node)
         const GumboNode *node = *children++;
         if (node->type == GUMBO_NODE_TEXT)
         {
+            // Statblocks generated by the same tool repeat the same style sheet,
+            // so only decode each distinct sheet once.
+            const QByteArray sheet = QByteArray::fromRawData(node->v.text.text, int(qstrlen(node->v.text.text)));
+            auto cached = decoded_style_sheets.constFind(sheet);
+            if (cached != decoded_style_sheets.constEnd())
+            {
+                add_styles(result, cached.value());
+                continue;
+            }
+            GumboStyles styles;
             // each line is of the form:
             // .cs1157FFE2{text-align:right;text-indent:0pt;margin:0pt 0pt 0pt 0pt}
             QString body(node->v.text.text);
@@ -995,9 +1024,12 @@ GumboStyles getStyles(const GumboNode *node)
                     if (parts.length() != 2) {
                         qWarning() << "Invalid syntax in GUMBO style: " << line;
                     }
-                    result.insert(parts.first().mid(1), TextStyle::fromStyle(parts.last()));
+                    styles.insert(parts.first().mid(1), TextStyle::fromStyle(parts.last()));
                 }
             }
+            // Take a deep copy of the key, since the gumbo tree is about to be freed.
+            decoded_style_sheets.insert(QByteArray(sheet.constData(), sheet.size()), styles);
+            add_styles(result, styles);
         }
     }
     return result;
@@ -1017,46 +1049,157 @@ static const QString escape_bracket(const QString &input)
     return result;
 }
 
+#ifdef BENCHMARK_DICE
 /**
- * @brief replace_dice
- * Examine @string for any patterns that might be dice rolls, and replace with `dice: <expr>`
+ * @brief replace_dice_regexp
+ * The original regular expression version of replace_dice, kept only for benchmarkDice.
  * @param string
  */
-static void replace_dice(QString &string)
+static void replace_dice_regexp(QString &string)
 {
     // regex101.com says the following is correct:   ([^\w]|^)(\d*[dD]\d+(\s*[+-]\s*(\d*[dD]\d+|\d+))*)($|[^\w])
     // the REGEXP has to check that letters don't immediately precede or follow the match
     // but we have to escape each backslash
     static const QRegularExpression dice_regexp("(^|[^\\w])(\\d*[dD]\\d+(\\s*[+-]\\s*(\\d*[dD]\\d+|\\d+))*)($|[^\\w])", QRegularExpression::UseUnicodePropertiesOption);
-  //  static const QRegularExpression dice_regexp("(^|[^\\w])\\d*[dD]\\d+(\\s*[+-]\\s*(\\d*[dD]\\d+|\\d+))*($|[^\\w])", QRegularExpression::UseUnicodePropertiesOption|QRegularExpression::DontCaptureOption);
-    if (!dice_regexp.isValid()) qDebug() << "dice_regexp is invalid:" << dice_regexp.errorString();
     QRegularExpressionMatchIterator it = dice_regexp.globalMatch(string);
     if (!it.hasNext()) return;
 
     // The iterator only runs forward, so get the pairs into reverse order
     struct Pair { int start, last; };
     QStack<Pair> pairs;
-    pairs.reserve(10);
     while (it.hasNext())
     {
-        // Match #2 contains the actual expression, rather than the check markers either side
-        // which avoid letters touching the front or back of the suspected dice string.
         QRegularExpressionMatch match = it.next();
-        if (match.lastCapturedIndex() < 2)
-        {
-            qWarning() << "replace_dice didn't find two matching expressions: which it always should!";
-            continue;
-        }
         pairs.append(Pair{match.capturedStart(2), match.capturedEnd(2) });
     }
-    // Update the string starting at the end and working backwards
     while (!pairs.isEmpty())
     {
         Pair set = pairs.pop();
-        string.insert(set.last, '`');       // do this FIRST, before the string is shifted right
+        string.insert(set.last, '`');
         string.insert(set.start, "`dice: ");
     }
 }
+#endif
+
+// Equivalent to \w with QRegularExpression::UseUnicodePropertiesOption
+static inline bool is_word_char(QChar ch)
+{
+    return ch.isLetterOrNumber() || ch.isMark() || ch == '_';
+}
+
+/**
+ * @brief dice_term
+ * Matches either \d*[dD]\d+ or (if allow_number) \d+ starting at pos.
+ * @return the position after the term, or -1 if there is no term at pos
+ */
+static inline int dice_term(const QString &string, int pos, bool allow_number)
+{
+    const int length = string.length();
+    int end = pos;
+    while (end < length && string.at(end).isDigit()) end++;
+    if (end + 1 < length && (string.at(end) == 'd' || string.at(end) == 'D') && string.at(end+1).isDigit())
+    {
+        end += 2;
+        while (end < length && string.at(end).isDigit()) end++;
+        return end;
+    }
+    return (allow_number && end > pos) ? end : -1;
+}
+
+/**
+ * @brief replace_dice
+ * Examine @string for any patterns that might be dice rolls, and replace with `dice: <expr>`
+ *
+ * A dice roll matches  \d*[dD]\d+(\s*[+-]\s*(\d*[dD]\d+|\d+))*
+ * and must not have a word character immediately before or after it.
+ * The string is scanned once, and the output only built if a dice roll is found.
+ * As with the regular expression that this replaces, the character following one dice roll
+ * can't also be the character preceding the next dice roll.
+ * @param string
+ */
+static void replace_dice(QString &string)
+{
+    const int length = string.length();
+    QString result;
+    int copied = 0;         // characters of string already copied to result
+    int search_from = 0;    // first character which can be the separator in front of a dice roll
+
+    for (int start = 0; start < length; start++)
+    {
+        const QChar ch = string.at(start);
+        if (!ch.isDigit() && ch != 'd' && ch != 'D') continue;
+        if (start > 0 && (start - 1 < search_from || is_word_char(string.at(start - 1)))) continue;
+
+        int end = dice_term(string, start, false);
+        if (end < 0) continue;
+
+        // Extend with as many "+/- term" as possible, remembering the last end which
+        // is followed by a non-word character (or the end of the string).
+        int last = (end == length || !is_word_char(string.at(end))) ? end : -1;
+        forever
+        {
+            int pos = end;
+            while (pos < length && string.at(pos).isSpace()) pos++;
+            if (pos == length || (string.at(pos) != '+' && string.at(pos) != '-')) break;
+            pos++;
+            while (pos < length && string.at(pos).isSpace()) pos++;
+            pos = dice_term(string, pos, true);
+            if (pos < 0) break;
+            end = pos;
+            if (end == length || !is_word_char(string.at(end))) last = end;
+        }
+        if (last < 0) continue;
+
+        if (result.isEmpty()) result.reserve(length + 64);
+        result.append(string.midRef(copied, start - copied));
+        result.append("`dice: ");
+        result.append(string.midRef(start, last - start));
+        result.append('`');
+        copied = last;
+        // The character after the dice roll is consumed as its trailing separator.
+        search_from = last + 1;
+        start = last;
+    }
+    if (copied == 0) return;
+    result.append(string.midRef(copied));
+    string = result;
+}
+
+#ifdef BENCHMARK_DICE
+/**
+ * @brief benchmarkDice
+ * Compares the speed (and output) of replace_dice against the original regular expression.
+ * It is run from main() when the application is started with --benchmark-dice.
+ */
+void benchmarkDice()
+{
+    static const QStringList samples{
+        "Hit: 7 (1d8 + 3) slashing damage plus 3 (1d6) fire damage.",
+        "Roll 2d6+1d4 - 2 for the damage, or d20 to hit. Nothing here at all.",
+        "The d6d8 and 3d6x values are not dice, but (d4) and 4d10-1. are.",
+        "A long paragraph of descriptive text without any dice expressions in it, which is the common case for most content.",
+        "Hit Points 45 (7d8 + 14)\nSpeed 30 ft.\nMultiattack. The creature makes two attacks: 1d6+2, 1d6+2 and 2D4 - 1",
+    };
+    const int loops = 20000;
+    for (const auto &sample : samples)
+    {
+        QString a(sample), b(sample);
+        replace_dice(a);
+        replace_dice_regexp(b);
+        if (a != b) qWarning() << "benchmarkDice: different results for" << sample << "\n  scanner:" << a << "\n  regexp: " << b;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < loops; i++)
+        for (const auto &sample : samples) { QString copy(sample); replace_dice(copy); }
+    const qint64 scanner_time = timer.nsecsElapsed();
+    timer.restart();
+    for (int i = 0; i < loops; i++)
+        for (const auto &sample : samples) { QString copy(sample); replace_dice_regexp(copy); }
+    const qint64 regexp_time = timer.nsecsElapsed();
+    qInfo() << "benchmarkDice: scanner =" << scanner_time / 1000000 << "ms, regexp =" << regexp_time / 1000000 << "ms for" << loops * samples.size() << "strings";
+}
+#endif
 
 /**
  * @brief getTextChildren
@@ -1120,13 +1263,13 @@ static const GumboNode *getGumboChild(const GumboNode *parent, const QString &na
  * @param node
  * @return
  */
-static const QString textContent(const QString &source, bool dice=true)
+static const QString textContent(const QByteArray &source, bool dice=true)
 {
     // If no HTML, then simply return the original text.
-    if (source.indexOf(">") < 0) return source;
+    if (source.indexOf('>') < 0) return QString::fromUtf8(source);
 
     QString result;
-    GumboOutput *output = gumbo_parse(source.toUtf8());
+    GumboOutput *output = gumbo_parse(source);
     if (output) {
         if (output->root)
         {
@@ -1143,6 +1286,13 @@ static const QString textContent(const QString &source, bool dice=true)
     return result;
 }
 
+static inline const QString textContent(const QString &source, bool dice=true)
+{
+    // Avoid the UTF-8 conversion when there is no HTML to parse.
+    if (source.indexOf(">") < 0) return source;
+    return textContent(source.toUtf8(), dice);
+}
+
 
 static QString get_elem_string(XmlElement *elem)
 {
@@ -1168,75 +1318,27 @@ static const QString write_image(const QString &image_name, const QByteArray &or
                        const QString &usemap = QString(), const QList<XmlElement*> pins = QList<XmlElement*>())
 {
     Q_UNUSED(usemap)
-    QBuffer buffer;
     QString filename = orig_filename;
-    QString format = filename.split(".").last();
-    int divisor = 1;
+    const int divisor = 1;
     const int pin_size = 20;
-    bool in_buffer = false;
-
-    // Need to decode image, to get size
-    QImage image = QImage::fromData(orig_data, qPrintable(format));
-    QSize image_size = image.size();
 
-    // See if possible image conversion is required
-    bool bad_format = (format == "bmp" || format == "tif" || format == "tiff");
-    if (mask_elem != nullptr || bad_format)
+    // Format conversion and mask are shared with the other output formats
+    const ImageAsset asset = prepareImage(orig_data, orig_filename, mask_elem, apply_reveal_mask, /*max_width*/ 0);
+    const QSize image_size = asset.size;
+    if (asset.format != filename.split(".").last())
     {
-        if (bad_format)
-        {
-            format = "png";
-            in_buffer = true;
-            int last = filename.lastIndexOf(".");
-            filename = filename.mid(0,last) + ".png";
-        }
-
-        // Apply mask, if supplied
-        if (mask_elem && apply_reveal_mask)
-        {
-            // If the mask is empty, then don't use it
-            // (if the image is JPG, the mask isn't necessarily JPG
-            QImage mask = QImage::fromData(mask_elem->byteData());
-
-            // Ensure we have a 32-bit image to convert
-            image = image.convertToFormat(QImage::Format_RGB32);
-
-            // Create a mask with the correct alpha
-            QPixmap pixmap(image.size());
-            pixmap.fill(QColor(0, 0, 0, 200));
-            pixmap.setMask(QBitmap::fromImage(mask));
-
-            if (image.size() != mask.size())
-            {
-                qWarning() << "Image size differences for" << orig_filename << ": image =" << image.size() << ", mask =" << mask.size();
-            }
-            // Apply the mask to the original picture
-            QPainter painter(&image);
-            painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
-            painter.drawPixmap(0, 0, pixmap);
-
-            //format = "png";   // not always better (especially if was JPG)
-            in_buffer = true;
-        } /* mask */
-
-        // Do we need to put it in the buffer?
-        if (in_buffer)
-        {
-            buffer.open(QIODevice::WriteOnly);
-            image.save(&buffer, qPrintable(format));
-            buffer.close();
-            in_buffer = true;
-        }
+        int last = filename.lastIndexOf(".");
+        filename = filename.mid(0,last) + "." + asset.format;
     }
 
     // Put it into a separate file
-    QFile file(dirFile(assetsDir, filename));
+    OutputFile file(dirFile(assetsDir, filename));
     if (!file.open(QFile::WriteOnly))
     {
         qWarning() << "writeExtObject: failed to open file for writing:" << filename;
         return 0;
     }
-    file.write (in_buffer ? buffer.data() : orig_data);
+    file.write (asset.data);
     file.close();
 
     QString result;
@@ -1261,11 +1363,11 @@ static const QString write_image(const QString &image_name, const QByteArray &or
         // Create the clickable MAP on top of the map
         foreach (const auto &pin, pins)
         {
-            int x = pin->attribute("x").toInt() / divisor;
-            int y = pin->attribute("y").toInt() / divisor - pin_size;
+            int x = pin->intAttribute("x") / divisor;
+            int y = pin->intAttribute("y") / divisor - pin_size;
 
             // Build up a tooltip from the text configured on the pin
-            QString link = pin->attribute("topic_id");
+            QString link = pin->attribute(XmlElement::KEY_TOPIC_ID);
 #ifdef TOOLTIP
             QString pin_name = pin->attribute("pin_name");
             QString description = get_elem_string(pin->xmlChild("description"));
@@ -1298,9 +1400,14 @@ static const QString write_image(const QString &image_name, const QByteArray &or
 }
 
 
+/**
+ * @brief write_binary_file
+ * Queues the file to be written to disk (failures to write it are counted by waitForOutputFiles).
+ * @return false if the file couldn't be created
+ */
 static bool write_binary_file(const QString &filename, const QByteArray &data)
 {
-    QFile file(dirFile(assetsDir, filename));
+    OutputFile file(dirFile(assetsDir, filename));
     if (!file.open(QFile::WriteOnly))
     {
         qWarning() << "writeExtObject: failed to open file for writing:" << filename;
@@ -1396,17 +1503,38 @@ static TextStyle inlineStyle(const GumboNode *node, const GumboStyles &cssStyles
 }
 
 
+static inline const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cssStyles, TextStyleManager &styleManager, int nestedTableCount=0, const QString &listtype=QString(), const bool allowWhitespace=false);
+
+/**
+ * @brief clean_spaces
+ * Replaces non-break spaces with normal spaces, and removes zero-width spaces,
+ * in the part of @text from position @from.
+ */
+static void clean_spaces(QString &text, int from)
+{
+    QChar *out = text.data() + from;
+    const QChar *end = text.constData() + text.length();
+    for (const QChar *in = out; in < end; ++in)
+    {
+        if (in->unicode() == 0x200b) continue;
+        *out++ = (in->unicode() == 0xa0) ? QChar(' ') : *in;
+    }
+    text.truncate(int(out - text.constData()));
+}
+
+
 /**
  * @brief decode_gumbo
- * Takes the GUMBO tree and calls the relevant methods of QTextStream
- * to reproduce it in Markdown.
+ * Takes the GUMBO tree and appends its Markdown equivalent to @result.
+ * @param result
  * @param node
  */
 
-static const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cssStyles, TextStyleManager &styleManager, int nestedTableCount=0, const QString &listtype=QString(), const bool allowWhitespace=false)
+static void decode_gumbo(QString &result, const GumboNode *parent, const GumboStyles &cssStyles, TextStyleManager &styleManager, int nestedTableCount=0, const QString &listtype=QString(), const bool allowWhitespace=false)
 {
-    QString result;
-    result.reserve(1000);
+    // Only the text appended by this call is seen by the style manager
+    const int result_start = result.length();
+    const int saved_floor  = styleManager.setFloor(result_start);
 
     // The current style, if any, that is in effect at this node level.
     // (child levels might change it independently of this style)
@@ -1464,7 +1592,7 @@ static const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cs
                 TextStyleManager para_style;  // each paragraph should have its own style information, starting from NO STYLING
                 QString paragraph;
                 para_style.start(paragraph, inlineStyle(node, cssStyles));
-                paragraph += decode_gumbo(node, cssStyles, para_style, nestedTableCount, listtype, /*allowWhitespace*/ true);
+                decode_gumbo(paragraph, node, cssStyles, para_style, nestedTableCount, listtype, /*allowWhitespace*/ true);
                 para_style.finish(paragraph);
 
                 // Check for line with only formatting and white space!
@@ -1528,7 +1656,7 @@ static const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cs
                 styleManager.change(result, original_style + TextStyle::fromNode(tag));
                 style_changed=true;
 
-                result += decode_gumbo(node, cssStyles, styleManager, nestedTableCount, listtype, allowWhitespace);
+                decode_gumbo(result, node, cssStyles, styleManager, nestedTableCount, listtype, allowWhitespace);
             }
             else if (tag == "hr")
             {
@@ -1628,7 +1756,7 @@ static const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cs
             }
             else if (nestedTableCount==1 && tag == "tbody")
             {
-                result += decode_gumbo(node, cssStyles, styleManager, nestedTableCount, listtype, allowWhitespace);
+                decode_gumbo(result, node, cssStyles, styleManager, nestedTableCount, listtype, allowWhitespace);
             }
             else if (tag == "ul")
             {
@@ -1642,7 +1770,7 @@ static const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cs
                     // Ensure this sublist is a BULLET list
                     newlisttype.replace("1.", "-");
                 }
-                result += decode_gumbo(node, cssStyles, styleManager, nestedTableCount, newlisttype, allowWhitespace);
+                decode_gumbo(result, node, cssStyles, styleManager, nestedTableCount, newlisttype, allowWhitespace);
                 // Blank line after last line of nested list only
                 if (listtype.isEmpty()) result += newline;
             }
@@ -1658,15 +1786,16 @@ static const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cs
                     // Ensure this sublist is a NUMBERED list
                     newlisttype.replace("-", "1.");
                 }
-                result += decode_gumbo(node, cssStyles, styleManager, nestedTableCount, newlisttype, allowWhitespace);
+                decode_gumbo(result, node, cssStyles, styleManager, nestedTableCount, newlisttype, allowWhitespace);
                 // Blank line after last line of nested list only
                 if (listtype.isEmpty()) result += newline;
             }
             else if (tag == "li")
             {
-                result += listtype + decode_gumbo(node, cssStyles, styleManager, nestedTableCount, listtype, allowWhitespace);
+                result += listtype;
+                decode_gumbo(result, node, cssStyles, styleManager, nestedTableCount, listtype, allowWhitespace);
                 // If this is the <li> after a nested list, then we might end up with too many \n.
-                if (!result.endsWith(newline)) result += newline;
+                if (result.length() == result_start || !result.endsWith(newline)) result += newline;
             }
             else if (tag.length() == 2 && tag[0] == 'h' && tag[1].isDigit())
             {
@@ -1694,7 +1823,7 @@ static const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cs
                     parts.append(QString("%1=%2").arg(attr->name, quotes(attr->value)));
                 }
                 result += "<" + parts.join(' ') + ">";
-                result += decode_gumbo(node, cssStyles, styleManager, nestedTableCount, listtype, local_allowWhitespace);
+                decode_gumbo(result, node, cssStyles, styleManager, nestedTableCount, listtype, local_allowWhitespace);
                 result += "</" + tag + ">";
             }
             // end of GUMBO_NODE_ELEMENT
@@ -1711,7 +1840,16 @@ static const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cs
     // Cancel any final style if one is currently being processed.
     if (style_changed) styleManager.change(result, original_style);
 
-    return result.replace("\u00a0"," ").replace("\u200b","");
+    clean_spaces(result, result_start);
+    styleManager.setFloor(saved_floor);
+}
+
+
+static inline const QString decode_gumbo(const GumboNode *parent, const GumboStyles &cssStyles, TextStyleManager &styleManager, int nestedTableCount, const QString &listtype, const bool allowWhitespace)
+{
+    QString result;
+    decode_gumbo(result, parent, cssStyles, styleManager, nestedTableCount, listtype, allowWhitespace);
+    return result;
 }
 
 
@@ -1837,39 +1975,101 @@ static inline QString st_save(XmlElement *character, const QString &prefix, cons
 }
 
 /**
- * @brief write_5e_statblock
- * Adds terminating newline
- * @param constxml
- * @return
+ * @brief The StatblockFiles class
+ * The XML files within one portfolio, each parsed at most once no matter how many of
+ * the portfolio's characters (or output sections) refer to it.
+ * All the parsed trees are deleted when the portfolio has been written.
  */
-static const QString write_5e_statblock(const QMap<QString,QByteArray> &image_files, const QByteArray &constxml)
+class StatblockFiles
 {
-    QString finalresult;
+public:
+    StatblockFiles(const Portfolio &portfolio) : portfolio(portfolio) {}
+    ~StatblockFiles() { qDeleteAll(trees); }
 
-    QByteArray xml(constxml);   // convert from const to non-const
-    QBuffer buffer(&xml);
-    if (!buffer.open(QBuffer::ReadOnly))
+    /**
+     * @brief tree
+     * @param filename the name of the file within the portfolio
+     * @return the parsed file, or nullptr if the file is missing or can't be parsed
+     */
+    const XmlElement *tree(const QString &filename)
     {
-        qWarning() << "write_5e_statblock: failed to open XML string buffer";
-        return QString();
+        auto it = trees.constFind(filename);
+        if (it != trees.constEnd()) return it.value();
+
+        XmlElement *result = nullptr;
+        if (portfolio.contains(filename))
+        {
+            QByteArray xml = portfolio.file(filename);
+            QBuffer buffer(&xml);
+            if (!buffer.open(QBuffer::ReadOnly))
+                qWarning() << "Failed to open file from portfolio:" << filename;
+            else
+                result = XmlElement::readTree(&buffer);
+        }
+        trees.insert(filename, result);
+        return result;
     }
-    XmlElement *tree = XmlElement::readTree(&buffer);
+
+    /**
+     * @brief character
+     * @param filename the name of the statblock file within the portfolio
+     * @param name the name of the character
+     * @return the <character> element for the named character
+     */
+    const XmlElement *character(const QString &filename, const QString &name)
+    {
+        auto it = characters.find(filename);
+        if (it == characters.end())
+        {
+            it = characters.insert(filename, QHash<QString,const XmlElement*>());
+            if (const XmlElement *stat = tree(filename))
+            {
+                for (auto onechar : stat->findChildren<XmlElement*>("character"))
+                {
+                    // Keep the first character with each name
+                    const QString &charname = onechar->attribute("name");
+                    if (!it->contains(charname)) it->insert(charname, onechar);
+                }
+            }
+        }
+        return it->value(name);
+    }
+
+private:
+    const Portfolio &portfolio;
+    QHash<QString,XmlElement*> trees;                                   // key=filename
+    QHash<QString,QHash<QString,const XmlElement*>> characters;         // key=filename, then character name
+};
+
+
+/**
+ * @brief write_5e_statblock
+ * Appends a statblock for each character to @result.
+ * Adds terminating newline
+ * @param result
+ * @param tree the parsed statblock XML file
+ */
+static void write_5e_statblock(QString &result, const QMap<QString,QByteArray> &image_files, const XmlElement *tree)
+{
     if (!tree)
     {
         qWarning() << "write_5e_statblock: failed to parse XML in string buffer";
-        return QString();
+        return;
     }
 
     QList<XmlElement*> children = tree->findChildren<XmlElement*>("character");
     if (children.isEmpty())
     {
         qWarning() << "write_5e_statblock: failed to find <character> in XML string buffer";
-        return QString();
+        return;
     }
 
     for (XmlElement *character : children)
     {
-        QString result;
+        // Put the statblock wrapper on the result (removed again if nothing is written)
+        const int block_start = result.length();
+        result += codeblock + "statblock" + newline;
+        const int stats_start = result.length();
         QString temp;
 
         QStringList senses;
@@ -1984,7 +2184,7 @@ static const QString write_5e_statblock(const QMap<QString,QByteArray> &image_fi
 
                 QString value = quotes(name) + ", " + quotes(stattext(special->xmlChild("description")));
 
-                QString type = special->attribute("type");
+                QString type = special->attribute(XmlElement::KEY_TYPE);
                 if (type == "Action")
                     actions.append(value);
                 else if (type == "Legendary")
@@ -2214,28 +2414,22 @@ reactions:
     - ...
 #endif
 
-        // Put the statblock wrapper on the result
-        if (!result.isEmpty())
-        {
-            result.prepend(codeblock + "statblock" + newline);
+        if (result.length() == stats_start)
+            result.truncate(block_start);
+        else
             result.append(codeblock + newline);
-        }
-
-        finalresult += result;
     } /* for each child */
-
-    return finalresult;
 }
 
 /**
- * @brief write_html
+ * @brief render_html
  * No newline at the end
  * @param use_fixed_title
  * @param sntype
  * @param data
  * @return
  */
-static const QString write_html(bool use_fixed_title, const QString &sntype, const QByteArray &data)
+static const QString render_html(bool use_fixed_title, const QString &sntype, const QByteArray &data)
 {
     // Put the children of the BODY into this frame.
     GumboOutput *output = gumbo_parse(data);
@@ -2295,6 +2489,125 @@ static const QString write_html(bool use_fixed_title, const QString &sntype, con
     return result;
 }
 
+/**
+ * @brief write_html
+ * As render_html, but a fragment which has already been converted during this export
+ * (e.g. the same statblock in several topics) is taken from html_cache.
+ */
+static const QString write_html(bool use_fixed_title, const QString &sntype, const QByteArray &data)
+{
+    const QByteArray key = RenderCache<QString>::key(data, sntype + (use_fixed_title ? "|fixed" : "|title"));
+    QString result;
+    if (html_cache.find(key, result)) return result;
+    result = render_html(use_fixed_title, sntype, data);
+    html_cache.insert(key, result);
+    return result;
+}
+
+/**
+ * @brief simple_text_content
+ * A quick version of textContent for the source of a link, which is usually just
+ * the label inside a few inline elements (e.g. <span class="RWLink">label</span>).
+ * @param source
+ * @param result set to the text content
+ * @return false if GUMBO is needed to work out the text content (entities, carriage returns, block elements,
+ * whitespace-only text, incomplete tags, etc.)
+ */
+static bool simple_text_content(const QStringRef &source, QString &result)
+{
+    static const QStringList inline_tags{"span", "a", "b", "i", "u", "em", "strong", "sup", "sub", "font"};
+    const int len = source.length();
+    int pos = 0;
+    result.clear();
+    while (pos < len)
+    {
+        const int lt  = source.indexOf('<', pos);
+        const int end = (lt < 0) ? len : lt;
+        if (end > pos)
+        {
+            QStringRef segment = source.mid(pos, end - pos);
+            if (segment.trimmed().isEmpty() || segment.contains('&') || segment.contains('\r') || segment.contains(QChar::Null)) return false;
+            if (pos == 0)
+            {
+                // An HTML parser puts whitespace before the first content into <head>, not <body>
+                int skip = 0;
+                while (skip < segment.length())
+                {
+                    const QChar ch = segment.at(skip);
+                    if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r' && ch != '\f') break;
+                    ++skip;
+                }
+                segment = segment.mid(skip);
+            }
+            result.append(segment);
+        }
+        if (lt < 0) break;
+
+        // Check that the tag is a complete inline element
+        int name_start = lt + 1;
+        if (name_start < len && source.at(name_start) == '/') ++name_start;
+        int name_end = name_start;
+        while (name_end < len && source.at(name_end).isLetter()) ++name_end;
+        if (!inline_tags.contains(source.mid(name_start, name_end - name_start).toString().toLower())) return false;
+
+        // Skip the attributes (which might contain a '>' inside quotes)
+        QChar quote;
+        int gt = name_end;
+        for (; gt < len; ++gt)
+        {
+            const QChar ch = source.at(gt);
+            if (!quote.isNull())
+            {
+                if (ch == quote) quote = QChar();
+            }
+            else if (ch == '"' || ch == '\'')
+                quote = ch;
+            else if (ch == '>')
+                break;
+        }
+        if (gt >= len) return false;
+        pos = gt + 1;
+    }
+    return true;
+}
+
+
+/**
+ * @brief link_label
+ * Returns the same as textContent(source), but without using GUMBO for simple links.
+ * @param source
+ * @return
+ */
+static inline const QString link_label(const QStringRef &source)
+{
+    if (source.indexOf('>') < 0) return source.toString();
+    QString result;
+    if (!simple_text_content(source, result)) return textContent(source.toString());
+    if (detect_dice_rolls) replace_dice(result);
+    return result;
+}
+
+
+/**
+ * @brief separate_links
+ * Checks whether the links (sorted by sortLinks) are all within the text and don't overlap,
+ * so they can be replaced in a single pass.
+ * @param links
+ * @param text_length
+ * @return
+ */
+static bool separate_links(const ExportLinks &links, int text_length)
+{
+    int limit = text_length;
+    for (const auto &link : links)
+    {
+        if (link.start < 0 || link.length < 0 || link.start + link.length > limit) return false;
+        limit = link.start;
+    }
+    return true;
+}
+
+
 /**
  * @brief get_content_text
  * Decodes the HTML contained in the specified @parent.
@@ -2310,40 +2623,76 @@ static const QString get_content_text(XmlElement *parent, const ExportLinks &lin
     qDebug() << "...write para-children";
 #endif
     QString result;
-    result.reserve(1000);
     if (!parent->xmlChild()) return "";
 
-    QString text{parent->childString()};
-    text.replace("&#xd;", "\n");    // Get to correct length for fixing links
-
-    // Now substitute any required links
-    foreach (const auto &link, links)
+    QByteArray bytes;
+    if (links.isEmpty())
     {
-        // Replace ONLY the text of the link, keeping the surrounding spans to handle formatting.
-        const QString source = text.mid(link.start,link.length);
-        const QString label  = textContent(source);
-        int pos = source.indexOf(label);
-        if (pos >= 0)
-            text.replace(link.start+pos, label.length(), escape_bracket(internal_link(link.target_id, label)));
+        // No links to substitute, so GUMBO can parse the stored UTF-8 directly.
+        bytes = parent->childBytes();
+        bytes.replace("&#xd;", "\n");
+    }
+    else
+    {
+        // Link positions are in characters, so the substitution works on a QString.
+        QString text{parent->childString()};
+        text.replace("&#xd;", "\n");    // Get to correct length for fixing links
+
+        // Now substitute any required links
+        if (separate_links(links, text.length()))
+        {
+            // Build the new text in a single pass, from the lowest link to the highest.
+            QString linked;
+            linked.reserve(text.length() + links.size() * 64);
+            int copied = 0;
+            for (auto link = links.crbegin(); link != links.crend(); ++link)
+            {
+                // Replace ONLY the text of the link, keeping the surrounding spans to handle formatting.
+                const QStringRef source = text.midRef(link->start, link->length);
+                const QString label = link_label(source);
+                int pos = source.indexOf(label);
+                // If the label isn't found, then replace everything (and just suffer the problems with formatting)
+                const int start = (pos >= 0) ? link->start + pos : link->start;
+                linked.append(text.midRef(copied, start - copied));
+                linked.append(escape_bracket(internal_link(link->target_id, label)));
+                copied = start + ((pos >= 0) ? label.length() : link->length);
+            }
+            linked.append(text.midRef(copied));
+            text = linked;
+        }
         else
         {
-            //qDebug() << "textContent not found in" << source;
-            //qDebug() << "       - textContent =" << label;
-            // Failed to find the label, so replace everything (and just suffer the problems with formatting)
-            text.replace(link.start, link.length, escape_bracket(internal_link(link.target_id, label)));
+            // Overlapping links: each replacement has to see the result of the previous ones.
+            foreach (const auto &link, links)
+            {
+                // Replace ONLY the text of the link, keeping the surrounding spans to handle formatting.
+                const QString source = text.mid(link.start,link.length);
+                const QString label  = textContent(source);
+                int pos = source.indexOf(label);
+                if (pos >= 0)
+                    text.replace(link.start+pos, label.length(), escape_bracket(internal_link(link.target_id, label)));
+                else
+                {
+                    //qDebug() << "textContent not found in" << source;
+                    //qDebug() << "       - textContent =" << label;
+                    // Failed to find the label, so replace everything (and just suffer the problems with formatting)
+                    text.replace(link.start, link.length, escape_bracket(internal_link(link.target_id, label)));
+                }
+            }
         }
+        bytes = text.toUtf8();
     }
 
-    if (text.startsWith("<"))
+    if (bytes.startsWith('<'))
     {
-        GumboOutput *output = gumbo_parse(text.toUtf8());
+        GumboOutput *output = gumbo_parse(bytes);
         if (output) {
             if (output->root)
             {
                 if (auto body = getGumboChild(output->root, "body"))
                 {
                     GumboStyles cssStyles;
-                    result += read_gumbo(body, cssStyles);
+                    result = read_gumbo(body, cssStyles);
                 }
             }
             // Get GUMBO to release all the memory
@@ -2353,7 +2702,7 @@ static const QString get_content_text(XmlElement *parent, const ExportLinks &lin
     else
     {
         // No embedded HTML
-        result = text;
+        result = QString::fromUtf8(bytes);
     }
     if (dice && detect_dice_rolls) replace_dice(result);
 
@@ -2443,7 +2792,7 @@ static inline QString gregorian(const QString &source)
  * @param character
  * @return
  */
-static inline QString encounter_creature(XmlElement *character)
+static inline QString encounter_creature(const XmlElement *character)
 {
     // Remove trailing #<digit> from creature name (if present)
     QString name = character->attribute("name");
@@ -2475,11 +2824,11 @@ static inline QString encounter_creature(XmlElement *character)
 }
 
 
-static const QString write_snippet(XmlElement *snippet)
+static void write_snippet(QString &result, XmlElement *snippet)
 {
-    const QString sn_type     = snippet->attribute("type");
+    const QString sn_type     = snippet->attribute(XmlElement::KEY_TYPE);
     const QString sn_veracity = snippet->attribute("veracity");
-    QString sn_style          = snippet->attribute("style"); // Read_Aloud, Callout, Flavor, Handout  - not const since might get cancelled
+    QString sn_style          = snippet->attribute(XmlElement::KEY_STYLE); // Read_Aloud, Callout, Flavor, Handout  - not const since might get cancelled
     QString endspan{newline};   // Might be </span>
     bool inspan=false;
 #if DUMP_LEVEL > 3
@@ -2499,9 +2848,9 @@ static const QString write_snippet(XmlElement *snippet)
             {
                 foreach (const auto &span, span_list->xmlChildren("span"))
                 {
-                    const int start  = span->attribute("start").toInt();
-                    const int length = span->attribute("length").toInt();
-                    if (span->attribute("directions").toInt() == 1)
+                    const int start  = span->intAttribute("start");
+                    const int length = span->intAttribute("length");
+                    if (span->intAttribute("directions") == 1)
                         gmlinks.append(ExportLink(target_id, start, length));   // GM-directions
                     else
                         links.append(ExportLink(target_id, start, length));     // normal content
@@ -2513,8 +2862,7 @@ static const QString write_snippet(XmlElement *snippet)
     sortLinks(links);
     sortLinks(gmlinks);
 
-    QString result;
-    result.reserve(1000);
+    const int snippet_start = result.length();
 
     // Put GM-Directions first - which could occur on any snippet
     QString line_prefix;
@@ -2628,22 +2976,21 @@ static const QString write_snippet(XmlElement *snippet)
                     if (create_5e_statblocks || create_statblocks || initiative_tracker)
                     {
                         // Put in markers for statblock
-                        QByteArray store = contents->byteData();
-                        QBuffer buffer(&store);
-                        QuaZip zip(&buffer);
+                        const Portfolio portfolio = readPortfolio(contents->byteData());
                         QMap<QString,QByteArray> image_files;
-                        if (zip.open(QuaZip::mdUnzip))
+                        if (portfolio.valid)
                         {
+                            // Each XML file is parsed once, and released when this portfolio is finished
+                            StatblockFiles xml_files(portfolio);
+
                             // Put encounter block BEFORE other stat blocks
-                            if (initiative_tracker && zip.setCurrentFile("index.xml"))
+                            if (initiative_tracker && portfolio.contains("index.xml"))
                             {
-                                QuaZipFile indexfile(&zip);
-                                if (!indexfile.open(QuaZipFile::ReadOnly))
-                                    qWarning() << "Failed to open index file from zip: " << zip.getCurrentFileName();
+                                const XmlElement *index = xml_files.tree("index.xml");
+                                if (!index)
+                                    qWarning() << "Failed to read index file from zip";
                                 else
                                 {
-                                    XmlElement *index = XmlElement::readTree(&indexfile);
-                                    QString system = index->findChild<XmlElement*>("game")->attribute("folder");
                                     QStringList creatures;
                                     const auto characters = index->findChildren<XmlElement*>("character");
                                     for (auto child : characters)
@@ -2651,8 +2998,8 @@ static const QString write_snippet(XmlElement *snippet)
                                         bool minion = child->parent()->objectName() == "minions";
 
                                         const XmlElement* statblocks = minion ? child->parent()->parent()->xmlChild("statblocks") : child->xmlChild("statblocks");
+                                        if (!statblocks) continue;
                                         QString statfilename;
-                                        QString imgfilename;
                                         for (auto statblock : statblocks->xmlChildren("statblock"))
                                         {
                                             if (statblock->attribute("format") == "xml") {
@@ -2660,30 +3007,16 @@ static const QString write_snippet(XmlElement *snippet)
                                                 break;
                                             }
                                         }
-                                        if (!statfilename.isEmpty() && zip.setCurrentFile(statfilename))
+                                        if (!statfilename.isEmpty() && portfolio.contains(statfilename))
                                         {
-                                            QuaZipFile statfile(&zip);
-                                            if (!statfile.open(QuaZipFile::ReadOnly))
-                                                qWarning() << "Failed to open statblock file from zip: " << zip.getCurrentFileName();
+                                            const XmlElement *character = xml_files.character(statfilename, child->attribute("name"));
+                                            if (character == nullptr)
+                                            {
+                                                qWarning() << "Failed to find character" << child->attribute("name") << "in statblock XML file";
+                                            }
                                             else
                                             {
-                                                XmlElement *stat = XmlElement::readTree(&statfile);
-                                                XmlElement *character = nullptr;
-                                                const auto characters = stat->findChildren<XmlElement*>("character");
-                                                for (auto onechar : characters)
-                                                    if (onechar->attribute("name") == child->attribute("name"))
-                                                    {
-                                                        character = onechar;
-                                                        break;
-                                                    }
-                                                if (character == nullptr)
-                                                {
-                                                    qWarning() << "Failed to find character" << child->attribute("name") << "in statblock XML file";
-                                                }
-                                                else
-                                                {
-                                                    creatures.append(encounter_creature(character));
-                                                }
+                                                creatures.append(encounter_creature(character));
                                             }
                                         }
 
@@ -2694,59 +3027,42 @@ static const QString write_snippet(XmlElement *snippet)
                             }
 
                             // Need to convert this HTML into markup
-                            for (bool more=zip.goToFirstFile(); more; more=zip.goToNextFile())
+                            for (const auto &file : portfolio.files)
                             {
-                                if (create_5e_statblocks && zip.getCurrentFileName().startsWith("images/"))
+                                if (create_5e_statblocks && file.name.startsWith("images/"))
                                 {
-                                    QuaZipFile file(&zip);
-                                    if (file.open(QuaZipFile::ReadOnly))
-                                        image_files.insert(zip.getCurrentFileName().mid(7), file.readAll());
+                                    image_files.insert(file.name.mid(7), file.data);
                                 }
-                                else if (create_5e_statblocks && zip.getCurrentFileName().startsWith("statblocks_xml/"))
+                                else if (create_5e_statblocks && file.name.startsWith("statblocks_xml/"))
                                 {
-                                    QuaZipFile file(&zip);
-                                    if (!file.open(QuaZipFile::ReadOnly))
-                                        qWarning() << "Failed to open XML file from zip: " << zip.getCurrentFileName();
-                                    else
-                                    {
-                                        result += write_5e_statblock(image_files, file.readAll());
-                                    }
+                                    write_5e_statblock(result, image_files, xml_files.tree(file.name));
                                 }
-                                else if (create_statblocks && zip.getCurrentFileName().startsWith("statblocks_html/"))
+                                else if (create_statblocks && file.name.startsWith("statblocks_html/"))
                                 {
-                                    // Collect images for later
-
-
-                                    QuaZipFile file(&zip);
-                                    if (!file.open(QuaZipFile::ReadOnly))
-                                        qWarning() << "Failed to open file from zip: " << zip.getCurrentFileName();
+                                    QString body = write_html(false, sn_type, file.data);
+                                    if (body.isEmpty())
+                                        qWarning() << "GUMBO failed to parse" << file.name;
                                     else
                                     {
-                                        QString body = write_html(false, sn_type, file.readAll());
-                                        if (body.isEmpty())
-                                            qWarning() << "GUMBO failed to parse" << zip.getCurrentFileName();
-                                        else
-                                        {
 #if 0
-                                            // THIS WORKS FOR PATHFINDER GENERATED FILES,
-                                            // BUT NOT FOR SOME OTHER GAME SYSTEMS (WHERE THEY HAVE STATS ON A SINGLE LINE BETWEEN TWO PARALLEL LINES)
-                                            // Replace section headers in portfolio HTML with proper section header.
-                                            // Ensure other line breaks have a blank line in front of them.
-                                            static const QRegularExpression header("\n---\n([^\n]+)\n---\n", QRegularExpression::UseUnicodePropertiesOption);
-                                            body.replace(header, "\n\n### \\1\n");
+                                        // THIS WORKS FOR PATHFINDER GENERATED FILES,
+                                        // BUT NOT FOR SOME OTHER GAME SYSTEMS (WHERE THEY HAVE STATS ON A SINGLE LINE BETWEEN TWO PARALLEL LINES)
+                                        // Replace section headers in portfolio HTML with proper section header.
+                                        // Ensure other line breaks have a blank line in front of them.
+                                        static const QRegularExpression header("\n---\n([^\n]+)\n---\n", QRegularExpression::UseUnicodePropertiesOption);
+                                        body.replace(header, "\n\n### \\1\n");
 #endif
 
-                                            // Ensure any --- marker has a blank line in front of it (don't add another if one already there!)
-                                            static const QRegularExpression line("([^\n])\n---\n", QRegularExpression::UseUnicodePropertiesOption);
-                                            body.replace(line, "\\1\n\n---\n");
-                                            if (!line_prefix.isEmpty()) body.replace("\n", "\n"+line_prefix);
+                                        // Ensure any --- marker has a blank line in front of it (don't add another if one already there!)
+                                        static const QRegularExpression line("([^\n])\n---\n", QRegularExpression::UseUnicodePropertiesOption);
+                                        body.replace(line, "\\1\n\n---\n");
+                                        if (!line_prefix.isEmpty()) body.replace("\n", "\n"+line_prefix);
 
-                                            // Ensure a blank line after the statblock
-                                            result += body + newline + newline;
-                                        }
+                                        // Ensure a blank line after the statblock
+                                        result += body + newline + newline;
                                     }
                                 }
-                            } /* for goToNextFile */
+                            } /* for portfolio.files */
                         }
                     } // if (create_5e_statblocks || create_statblocks)
                 }
@@ -2801,11 +3117,11 @@ static const QString write_snippet(XmlElement *snippet)
         {
             XmlElement *asset = smart_image->xmlChild("asset");
             XmlElement *mask  = smart_image->xmlChild("subset_mask");
-            if (asset == nullptr) return result;
+            if (asset == nullptr) return;
 
             QString filename = asset->attribute("filename");
             XmlElement *contents = asset->xmlChild("contents");
-            if (contents == nullptr) return result;
+            if (contents == nullptr) return;
 
             QString usemap;
             QList<XmlElement*> pins = smart_image->xmlChildren("map_pin");
@@ -2840,7 +3156,7 @@ static const QString write_snippet(XmlElement *snippet)
     {
         QStringList tags;
         foreach (const auto &tag, snippet->xmlChildren("tag_assign"))
-            tags.append(global_names.value(tag->attribute("tag_id")));
+            tags.append(global_names.value(tag->symbolAttribute("tag_id")));
         if (tags.length() > 0)
         {
             // In non-tag text before showing all connected tags
@@ -2863,40 +3179,33 @@ static const QString write_snippet(XmlElement *snippet)
     // Hybrid_Tag
 
     // Ensure blank line between snippets
-    if (!result.endsWith("\n\n"))
+    if (result.length() - snippet_start < 2 || !result.endsWith("\n\n"))
         result += newline;
-
-    return result;
 }
 
 
-static const QString write_section(XmlElement *section, int level)
+static void write_section(QString &result, XmlElement *section, int level)
 {
 #if DUMP_LEVEL > 2
     qDebug() << "..section" << section->attribute("name");
 #endif
 
-    QString result;
-    result.reserve(1000);
-
     // Start with HEADER for the section (H1 used for topic title)
     QString sname = section->attribute("name");
-    if (sname.isEmpty()) sname = global_names.value(section->attribute("partition_id"));
+    if (sname.isEmpty()) sname = global_names.value(section->symbolAttribute("partition_id"));
     result += heading(level+1, sname);
 
     // Write snippets
     foreach (const auto &snippet, section->xmlChildren("snippet"))
     {
-        result += write_snippet(snippet);
+        write_snippet(result, snippet);
     }
 
     // Write following sections
     foreach (const auto &subsection, section->xmlChildren("section"))
     {
-        result += write_section(subsection, level+1);
+        write_section(result, subsection, level+1);
     }
-
-    return result;
 }
 
 /**
@@ -2923,7 +3232,11 @@ static QString nav_link(const XmlElement *topic, const QString &override = QStri
 {
     QString result;
     if (topic && topic->objectName() == "topic")
+    {
+        auto target = link_targets.constFind(topic->attribute(XmlElement::KEY_TOPIC_ID));
+        if (target != link_targets.constEnd()) return target->nav_link;
         result = topic_link(topic);
+    }
     else if (!override.isEmpty())
         result = internal_link(override);
     else
@@ -3015,15 +3328,83 @@ static QString relationship(const XmlElement *connection)
 }
 
 
+/*
+ * The connections between topics.
+ * Every <connection> is decoded once, and then used both for the Connections section
+ * of its own topic and for the relationships page of its nature.
+ */
+struct Connection
+{
+    QString topic_id;           // topic_id of the topic containing the connection
+    QString target_id;
+    QString nature;
+    QString relationship;       // see relationship()
+    QString annotation;         // see annotationText(), without any prefix
+    bool    annotated;          // an <annotation> is present (even if it is empty)
+    QString label;              // label for the MERMAID link between topic_id and target_id
+};
+static QVector<Connection> all_connections;
+static QHash<const XmlElement*,QVector<int>> topic_connections;     // key=topic, value=index into all_connections of each direct child
+static QMap<QString,QVector<int>> nature_connections;               // key=nature, value=index into all_connections
+
+
+static const XmlElement *findTopicParent(const XmlElement *elem)
+{
+    QObject const * node = elem;
+    while (node && node->objectName() != "topic")
+        node = node->parent();
+    return qobject_cast<const XmlElement*>(node);
+}
+
+
+static void build_connection_graph(const XmlElement *root_elem)
+{
+    const auto elements = root_elem->findChildren<XmlElement*>("connection");
+    all_connections.reserve(elements.size());
+    for (const auto &element : elements)
+    {
+        const XmlElement *topic = findTopicParent(element);
+        if (!topic)
+        {
+            qWarning() << "build_connection_graph: failed to find topic node for connection!";
+            continue;
+        }
+
+        Connection connection;
+        connection.topic_id     = topic->attribute(XmlElement::KEY_TOPIC_ID);
+        connection.target_id    = element->attribute("target_id");
+        connection.nature       = element->attribute("nature");
+        connection.relationship = relationship(element);
+        connection.annotated    = element->xmlChild("annotation") != nullptr;
+        connection.annotation   = annotationText(element, false);
+
+        QString label = connection.relationship;
+        label.replace("-", newline);
+        if (!connection.annotation.isEmpty()) label += newline + connection.annotation;
+        if (!label.isEmpty()) connection.label = "-- " + quotes(label) + " ";
+
+        const int index = all_connections.size();
+        all_connections.append(connection);
+        if (element->parent() == topic) topic_connections[topic].append(index);
+        // Don't include child nodes on the relationship pages
+        if (connection.nature != "Minion_To_Master" &&
+            connection.nature != "Offspring_To_Parent")
+            nature_connections[connection.nature].append(index);
+    }
+}
+
+
+static QString topic_text;      // the sections of the topic currently being written
+
 static void write_topic_file(const XmlElement *topic, const XmlElement *parent, const XmlElement *prev, const XmlElement *next)
 {
 #if DUMP_LEVEL > 1
     qDebug() << ".topic" << topic->objectName() << ":" << topic_full_name.value(topic);
 #endif
-    QString category_name = global_names.value(topic->attribute("category_id"));
+    QString category_name = global_names.value(topic->symbolAttribute(XmlElement::KEY_CATEGORY_ID));
 
     // Create a new file for this topic
-    QFile topic_file(topicDirFile(topic));
+    OutputFile topic_file(topicDirFile(topic));
     if (!topic_file.open(QFile::WriteOnly|QFile::Text))
     {
         qWarning() << "Failed to open output file for topic" << topic_file.fileName();
@@ -3039,8 +3420,8 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
     //
     startFile(stream);
 
-    QString basename = topic->attribute("public_name");
-    bool name_alias = (topic_filename.value(topic->attribute("topic_id")) != basename);
+    QString basename = topic->attribute(XmlElement::KEY_PUBLIC_NAME);
+    bool name_alias = (topic_filename.value(topic->attribute(XmlElement::KEY_TOPIC_ID)) != basename);
 
     // Aliases belong in the metadata at the start of the file
     auto aliases = topic->xmlChildren("alias");
@@ -3063,7 +3444,7 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
 
     if (create_prefix_tag || frontmatter_prefix_suffix)
     {
-        QString prefix = topic->attribute("prefix");
+        QString prefix = topic->attribute(XmlElement::KEY_PREFIX);
         if (!prefix.isEmpty())
         {
             if (create_prefix_tag) tags.append(quotes(tag_string("Prefix", prefix)));
@@ -3072,7 +3453,7 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
     }
     if (create_suffix_tag || frontmatter_prefix_suffix)
     {
-        QString suffix = topic->attribute("suffix");
+        QString suffix = topic->attribute(XmlElement::KEY_SUFFIX);
         if (!suffix.isEmpty()) {
             if (create_suffix_tag) tags.append(quotes(tag_string("Suffix", suffix)));
             if (frontmatter_prefix_suffix) stream << "Suffix: " << quotes(suffix) << newline;
@@ -3085,11 +3466,11 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
     // School: name
     foreach (const auto &snippet, topicDescendents(topic, "snippet"))
     {
-        auto sntype = snippet->attribute("type");
+        auto sntype = snippet->attribute(XmlElement::KEY_TYPE);
         if (sntype == "Tag_Standard")
         {
             const XmlElement *tag = snippet->xmlChild("tag_assign");
-            if (tag) stream << validTag(global_names.value(snippet->attribute("facet_id"))) << ": " << quotes(global_names.value(tag->attribute("tag_id"))) << newline;
+            if (tag) stream << validTag(global_names.value(snippet->symbolAttribute("facet_id"))) << ": " << quotes(global_names.value(tag->symbolAttribute("tag_id"))) << newline;
         }
         else if (sntype == "Tag_Multi_Domain")
         {
@@ -3106,7 +3487,7 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
             if (auto contents = snippet->xmlChild("contents"))
             {
                 // No formatting in value!
-                QString value = textContent(contents->childString(), /*dice*/ false);
+                QString value = textContent(contents->childBytes(), /*dice*/ false);
 
                 // If content starts with \n then it might be a table, so add an extra blank line
                 if (value.length() < 60 &&
@@ -3131,17 +3512,17 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
 
     if (parent) {
         // Don't tell Breadcrumbs about the main page!
-        QString link = (parent->objectName() == "topic") ? topic_filename.value(parent->attribute("topic_id")) : validFilename(category_name);
+        QString link = (parent->objectName() == "topic") ? topic_filename.value(parent->attribute(XmlElement::KEY_TOPIC_ID)) : validFilename(category_name);
         stream << "parent:\n" + YAMLLIST << quotes(link) << "\nup:\n" + YAMLLIST << quotes(link) << newline;
     }
     if (prev)
     {
-        QString link = topic_filename.value(prev->attribute("topic_id"));
+        QString link = topic_filename.value(prev->attribute(XmlElement::KEY_TOPIC_ID));
         stream << "prev:\n" + YAMLLIST << quotes(link) << newline;
     }
     if (next)
     {
-        QString link = topic_filename.value(next->attribute("topic_id"));
+        QString link = topic_filename.value(next->attribute(XmlElement::KEY_TOPIC_ID));
         stream << "next:\n" + YAMLLIST << quotes(link) << newline;
         //stream << "same:\n" + YAMLLIST << link << newline;
     }
@@ -3151,16 +3532,18 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
         stream << "down:\n";
         foreach (const auto &child, topic->xmlChildren("topic"))
         {
-            stream << YAMLLIST << quotes(topic_filename.value(child->attribute("topic_id"))) << newline;
+            stream << YAMLLIST << quotes(topic_filename.value(child->attribute(XmlElement::KEY_TOPIC_ID))) << newline;
         }
     }
-    stream << "RWtopicId: " << quotes(topic->attribute("topic_id")) << newline;
+    stream << "RWtopicId: " << quotes(topic->attribute(XmlElement::KEY_TOPIC_ID)) << newline;
 
     // Connections
-    foreach (const auto &child, topic->xmlChildren("connection"))
+    const QVector<int> connections = topic_connections.value(topic);
+    for (int index : connections)
     {
+        const Connection &connection = all_connections.at(index);
         // Remove spaces from tag
-        stream << relationship(child).replace(" ", "") << ": " << quotes(internal_link(child->attribute("target_id"))) << newline;
+        stream << QString(connection.relationship).remove(' ') << ": " << quotes(internal_link(connection.target_id)) << newline;
     }
     stream << frontmatterMarker;
 
@@ -3181,17 +3564,16 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
 
     stream << heading(1, topic_full_name.value(topic));
 
-    // Process all <sections>, applying the linkage for this topic
+    // Process all <sections>, applying the linkage for this topic.
+    // All the sections are written into one buffer, which keeps its capacity from one topic to the next.
+    topic_text.resize(0);
     foreach (const auto &section, topic->xmlChildren("section"))
     {
-        // Remove leading and trailing white space (including blank lines)
-        // Replace two or more blank lines with just one blank line
-        QString text = write_section(section, /*level*/ 1);
-        //if (text.contains("\u00a0")) qWarning() << "\nText contains non-break-space at pos "  << text.indexOf("\u00a0") << "\n" << text;
-        //if (text.contains("\u200b")) qWarning() << "\nText contains ZERO-width-space at pos " << text.indexOf("\u200b") << "\n" << text;
-
-        stream << text;
+        write_section(topic_text, section, /*level*/ 1);
     }
+    //if (topic_text.contains("\u00a0")) qWarning() << "\nText contains non-break-space at pos "  << topic_text.indexOf("\u00a0") << "\n" << topic_text;
+    //if (topic_text.contains("\u200b")) qWarning() << "\nText contains ZERO-width-space at pos " << topic_text.indexOf("\u200b") << "\n" << topic_text;
+    stream << topic_text;
 
     // Provide summary of links to child topics
     auto child_topics = topic->xmlChildren("topic");
@@ -3199,7 +3581,7 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
     {
         stream << "---\n## Governed Content\n";
 
-        std::sort(child_topics.begin(), child_topics.end(), sort_topics);
+        topic_sorter.sort(child_topics, sort_by_prefix);
         foreach (const auto &child, child_topics)
         {
             stream << "- " << topic_link(child) << newline;
@@ -3207,51 +3589,43 @@ static void write_topic_file(const XmlElement *topic, const XmlElement *parent,
         stream << newline;  // blank line separator
     }
 
-    auto connections = topic->xmlChildren("connection");
-    if (connections.length() > 0)
+    if (!connections.isEmpty())
     {
         stream << "---\n## Connections\n";
         if (!connections_as_graph)
         {
-            foreach (const auto &connection, connections)
+            for (int index : connections)
             {
-                // Remove spaces from tag
-                stream << relationship(connection) << ": " << internal_link(connection->attribute("target_id")) << annotationText(connection) << newline;
+                const Connection &connection = all_connections.at(index);
+                stream << connection.relationship << ": " << internal_link(connection.target_id);
+                if (connection.annotated) stream << " ; " << connection.annotation;
+                stream << newline;
             }
         } else {
             // Now create a MERMAID flowchart
-            const QString topic_id    = topic->attribute("topic_id");
-
             QSet<QString> nodes;
             QSet<QString> relationships;
             QSet<QString> targets;
 
-            foreach (const auto &connection, connections)
+            for (int index : connections)
             {
-                QString source_id         = topic_id;
-                QString target_id         = connection->attribute("target_id");
-                const QString nature      = connection->attribute("nature");
-                const QString annotation  = annotationText(connection, false);  // not const so we can do annotation.replace later
+                const Connection &connection = all_connections.at(index);
+                QString source_id = connection.topic_id;
+                QString target_id = connection.target_id;
 
                 targets.insert("[[ " + topic_filename.value(target_id) + "]]");
 
                 // Need to be incoming links
-                if (nature_incoming.value(nature)) source_id.swap(target_id);
+                if (nature_incoming.value(connection.nature)) source_id.swap(target_id);
 
-                const QString arrow = nature_directional.value(nature) ? "-->" : "<-->";
+                const QString arrow = nature_directional.value(connection.nature) ? "-->" : "<-->";
 
                 // Add the source and target to the list of nodes
                 // (square brackets make the box have rounded ends instead of square)
                 nodes.insert(mermaid_node(source_id));
                 nodes.insert(mermaid_node(target_id));
 
-                QString label = relationship(connection);
-                label.replace("-", newline);
-                if (!annotation.isEmpty()) label += newline + annotation;
-
-                if (!label.isEmpty()) label = "-- " + quotes(label) + " ";
-
-                relationships.insert(source_id + label + arrow + target_id);
+                relationships.insert(source_id + connection.label + arrow + target_id);
             }
 
             if (!nodes.isEmpty() && !relationships.isEmpty())
@@ -3306,7 +3680,7 @@ static void write_topic_to_index(QTextStream &stream, XmlElement *topic, int lev
         auto child_topics = topic->xmlChildren("topic");
         if (!child_topics.isEmpty())
         {
-            std::sort(child_topics.begin(), child_topics.end(), sort_topics);
+            topic_sorter.sort(child_topics, sort_by_prefix);
             foreach (const auto &child_topic, child_topics)
             {
                 write_topic_to_index(stream, child_topic, level+1);
@@ -3324,8 +3698,9 @@ static void write_separate_index(const XmlElement *root_elem)
     XmlElement *details    = definition ? definition->xmlChild("details") : nullptr;
     mainPageName           = details    ? details->attribute("name") : "Table of Contents";
     topic_filename.insert(mainPageName, validFilename(mainPageName));
+    add_link_target(mainPageName, QString());
 
-    QFile out_file(mainPageName + ".md");
+    OutputFile out_file(mainPageName + ".md");
     if (!out_file.open(QFile::WriteOnly|QFile::Text))
     {
         qWarning() << "Failed to find file" << out_file.fileName();
@@ -3368,7 +3743,7 @@ static void write_separate_index(const XmlElement *root_elem)
             QMultiMap<QString,XmlElement*> categories;
             foreach (const auto &topic, child->xmlChildren("topic"))
             {
-                categories.insert(global_names.value(topic->attribute("category_id")), topic);
+                categories.insert(global_names.value(topic->symbolAttribute(XmlElement::KEY_CATEGORY_ID)), topic);
             }
 
             QStringList unique_keys(categories.uniqueKeys());
@@ -3380,7 +3755,7 @@ static void write_separate_index(const XmlElement *root_elem)
 
                 // Organise topics alphabetically
                 auto topics = categories.values(cat);
-                std::sort(topics.begin(), topics.end(), sort_topics);
+                topic_sorter.sort(topics, sort_by_prefix);
 
                 foreach (const auto &topic, topics)
                 {
@@ -3420,7 +3795,7 @@ static void write_category_files(const XmlElement *tree)
     QMultiMap<QString,XmlElement*> categories;
     foreach (const auto &topic, contents->xmlChildren("topic"))
     {
-        categories.insert(global_names.value(topic->attribute("category_id")), topic);
+        categories.insert(global_names.value(topic->symbolAttribute(XmlElement::KEY_CATEGORY_ID)), topic);
     }
     QStringList category_names(categories.uniqueKeys());
     category_names.sort();
@@ -3428,7 +3803,7 @@ static void write_category_files(const XmlElement *tree)
     foreach (const auto &catname, category_names)
     {
         QString filename = dirFile(validFilename(catname), validFilename(catname)) + ".md";
-        QFile file(filename);
+        OutputFile file(filename);
 
         // If it already exists, then don't change it;
         if (!file.open(QFile::WriteOnly))
@@ -3447,12 +3822,12 @@ static void write_category_files(const XmlElement *tree)
         stream << "up:\n" + YAMLLIST << quotes(mainPageName) << newline;
         stream << "down:\n";
         auto topics = categories.values(catname);
-        std::sort(topics.begin(), topics.end(), sort_topics);
+        topic_sorter.sort(topics, sort_by_prefix);
         foreach (const auto &topic, topics)
         {
-            if (global_names.value(topic->attribute("category_id")) == catname)
+            if (global_names.value(topic->symbolAttribute(XmlElement::KEY_CATEGORY_ID)) == catname)
             {
-                stream << YAMLLIST << quotes(topic_filename.value(topic->attribute("topic_id"))) << newline;
+                stream << YAMLLIST << quotes(topic_filename.value(topic->attribute(XmlElement::KEY_TOPIC_ID))) << newline;
             }
         }
         stream << "same:\n";
@@ -3467,72 +3842,39 @@ static void write_category_files(const XmlElement *tree)
 }
 
 
-static const XmlElement *findTopicParent(const XmlElement *elem)
-{
-    QObject const * node = elem;
-    while (node && node->objectName() != "topic")
-        node = node->parent();
-    return qobject_cast<const XmlElement*>(node);
-}
-
-
-static void write_relationships(const XmlElement *root_elem)
+static void write_relationships()
 {
     const QString folderName("Relationships");
 
-    QMultiMap<QString, const XmlElement*> connections;
-    foreach (const auto &connection, root_elem->findChildren<XmlElement*>("connection"))
-    {
-        QString nature = connection->attribute("nature");
-        // Don't include child nodes
-        if (nature == "Minion_To_Master" ||
-            nature == "Offspring_To_Parent")
-            continue;
-        connections.insert(nature, connection);
-    }
-
-    foreach (const auto &nature, connections.keys())
+    // One page for each nature of connection
+    for (auto it = nature_connections.constBegin(); it != nature_connections.constEnd(); ++it)
     {
+        const QString &nature = it.key();
         QSet<QString> nodes;
         QSet<QString> relationships;
 
         bool directional = nature_directional.value(nature);
         const QString arrow = directional ? "-->" : "<-->";
 
-        foreach (const auto &connection, connections.values(nature))
+        for (int index : it.value())
         {
-            const XmlElement *topic = findTopicParent(connection);
-            if (!topic)
-            {
-                qWarning() << "create_relationships: failed to find topic node for connection!";
-                continue;
-            }
-
-            const QString topic_id   = topic->attribute("topic_id");
-            //const QString topic_name = topic->attribute("public_name");
-            const QString target_id  = connection->attribute("target_id");
-            const QString annotation = annotationText(connection, false);  // not const so we can do annotation.replace later
+            const Connection &connection = all_connections.at(index);
 
             // Add the source and target to the list of nodes
             // (square brackets make the box have rounded ends instead of square)
-            nodes.insert(mermaid_node(topic_id));
-            nodes.insert(mermaid_node(target_id));
+            nodes.insert(mermaid_node(connection.topic_id));
+            nodes.insert(mermaid_node(connection.target_id));
 
             // If not directional, ensure it only occurs ONCE in the relationships SET
-            QString from=topic_id, to=target_id;
+            QString from=connection.topic_id, to=connection.target_id;
             if (!directional && from > to) from.swap(to);
 
-            QString label = relationship(connection);
-            label.replace("-", newline);
-            if (!annotation.isEmpty()) label += newline + annotation;
-            if (!label.isEmpty()) label = "-- " + quotes(label) + " ";
-
-            relationships.insert(from + label + arrow + to);
+            relationships.insert(from + connection.label + arrow + to);
         }
 
         if (!nodes.isEmpty() && !relationships.isEmpty())
         {
-            QFile file(dirFile(folderName, nature_mapping.value(nature) + ".md"));
+            OutputFile file(dirFile(folderName, nature_mapping.value(nature) + ".md"));
 
             if (!file.open(QFile::WriteOnly|QFile::Text))
             {
@@ -3568,11 +3910,12 @@ static void write_storyboard(const XmlElement *root_elem)
         foreach (const auto &plot, plot_group->xmlChildren("plot"))
         {
             const QString plot_id   = plot->attribute("plot_id");
-            const QString plot_name = plot->attribute("public_name");
+            const QString plot_name = plot->attribute(XmlElement::KEY_PUBLIC_NAME);
 
             //qDebug() << "PLOT: " << plot_id << " := " << plot_name;
-            global_names.insert(plot_id, plot_name);
+            global_names.insert(plot->symbolAttribute("plot_id"), plot_name);
             topic_filename.insert(plot_id, validFilename(plot_name));
+            add_link_target(plot_id, plot_name);
         }
     }
 
@@ -3583,7 +3926,7 @@ static void write_storyboard(const XmlElement *root_elem)
 
         foreach (const auto &plot, plot_group->xmlChildren("plot"))
         {
-            const QString plot_name   = plot->attribute("public_name");
+            const QString plot_name   = plot->attribute(XmlElement::KEY_PUBLIC_NAME);
             const QString description = get_elem_string(plot->xmlChild("description"));
 
             QStringList nodes;
@@ -3615,7 +3958,7 @@ static void write_storyboard(const XmlElement *root_elem)
                         QString node_link = topic_filename.value(target_id);
                         if (node_link == node_name)
                             real_link = true;
-                        else if (node_name.isEmpty() || node_name.toLower() == global_names.value(target_id).toLower())
+                        else if (node_name.isEmpty() || node_name.toLower() == global_names.value(link->symbolAttribute("target_id")).toLower())
                         {
                             // If node has the BASE name (ignoring case), then use the topic name
                             node_name = node_link;
@@ -3636,7 +3979,7 @@ static void write_storyboard(const XmlElement *root_elem)
             }
 
             // Create the actual file!
-            QFile file(dirFile("Storyboard/" + group_name, plot_name + ".md"));
+            OutputFile file(dirFile("Storyboard/" + group_name, plot_name + ".md"));
             if (!file.open(QFile::WriteOnly))
             {
                 qWarning() << "Failed to open file for PLOT " << plot_name;
@@ -3673,35 +4016,35 @@ static void read_structure(XmlElement *structure)
         const QString tag_id = tag->attribute("tag_id");
         const QString name   = tag->attribute("name");
         tag_full_name.insert(tag_id, tag_string(tag->parent()->attribute("name"), name));
-        global_names.insert(tag_id, tag->attribute("name"));
+        global_names.insert(tag->symbolAttribute("tag_id"), tag->attribute("name"));
     }
     foreach (const auto &tag, structure->findChildren<XmlElement*>("tag"))   // parent is <domain>
     {
         const QString tag_id = tag->attribute("tag_id");
         const QString name   = tag->attribute("name");
         tag_full_name.insert(tag_id, tag_string(tag->parent()->attribute("name"), name));
-        global_names.insert(tag_id, tag->attribute("name"));
+        global_names.insert(tag->symbolAttribute("tag_id"), tag->attribute("name"));
     }
 
     foreach (const auto &cat, structure->findChildren<XmlElement*>("category_global"))
-        global_names.insert(cat->attribute("category_id"), cat->attribute("name"));
+        global_names.insert(cat->symbolAttribute(XmlElement::KEY_CATEGORY_ID), cat->attribute("name"));
     foreach (const auto &cat, structure->findChildren<XmlElement*>("category"))
-        global_names.insert(cat->attribute("category_id"), cat->attribute("name"));
+        global_names.insert(cat->symbolAttribute(XmlElement::KEY_CATEGORY_ID), cat->attribute("name"));
 
     foreach (const auto &facet, structure->findChildren<XmlElement*>("facet_global"))
-        global_names.insert(facet->attribute("facet_id"), facet->attribute("name"));
+        global_names.insert(facet->symbolAttribute("facet_id"), facet->attribute("name"));
     foreach (const auto &facet, structure->findChildren<XmlElement*>("facet"))
-        global_names.insert(facet->attribute("facet_id"), facet->attribute("name"));
+        global_names.insert(facet->symbolAttribute("facet_id"), facet->attribute("name"));
 
     foreach (const auto &facet, structure->findChildren<XmlElement*>("partition_global"))
-        global_names.insert(facet->attribute("partition_id"), facet->attribute("name"));
+        global_names.insert(facet->symbolAttribute("partition_id"), facet->attribute("name"));
     foreach (const auto &facet, structure->findChildren<XmlElement*>("partition"))
-        global_names.insert(facet->attribute("partition_id"), facet->attribute("name"));
+        global_names.insert(facet->symbolAttribute("partition_id"), facet->attribute("name"));
 
     foreach (const auto &facet, structure->findChildren<XmlElement*>("domain_global"))
-        global_names.insert(facet->attribute("domain_id"), facet->attribute("name"));
+        global_names.insert(facet->symbolAttribute("domain_id"), facet->attribute("name"));
     foreach (const auto &facet, structure->findChildren<XmlElement*>("domain"))
-        global_names.insert(facet->attribute("domain_id"), facet->attribute("name"));
+        global_names.insert(facet->symbolAttribute("domain_id"), facet->attribute("name"));
 }
 
 /**
@@ -3712,30 +4055,31 @@ static void read_structure(XmlElement *structure)
  * @param use_reveal_mask
  * @param folders_by_category  IF true, stores pages in folders named after category; if false then store pages based on topic hierarchy
  * @param do_obsidian_links
+ * @return the number of files which could not be written
  */
-void toMarkdown(const XmlElement *root_elem,
-                int  max_image_width,
-                bool create_leaflet_pins,
-                bool use_reveal_mask,
-                bool folders_by_category,
-                bool do_obsidian_links,
-                bool create_nav_panel,
-                bool tag_for_each_prefix,
-                bool tag_for_each_suffix,
-                bool graph_connections,
-                bool mark_dice_rolls,
-                bool mark_html_dice_rolls,
-                bool do_statblocks,
-                bool do_5e_statblocks,
-                bool add_admonition_gmdir,
-                bool add_admonition_rwstyle,
-                bool add_frontmatter_labeled_text,
-                bool add_frontmatter_numeric,
-                bool add_frontmatter_prefix_suffix,
-                bool add_initiative_tracker,
-                bool permit_table_extended,
-                bool create_category_templates,
-                bool link_por_file)
+int toMarkdown(const XmlElement *root_elem,
+               int  max_image_width,
+               bool create_leaflet_pins,
+               bool use_reveal_mask,
+               bool folders_by_category,
+               bool do_obsidian_links,
+               bool create_nav_panel,
+               bool tag_for_each_prefix,
+               bool tag_for_each_suffix,
+               bool graph_connections,
+               bool mark_dice_rolls,
+               bool mark_html_dice_rolls,
+               bool do_statblocks,
+               bool do_5e_statblocks,
+               bool add_admonition_gmdir,
+               bool add_admonition_rwstyle,
+               bool add_frontmatter_labeled_text,
+               bool add_frontmatter_numeric,
+               bool add_frontmatter_prefix_suffix,
+               bool add_initiative_tracker,
+               bool permit_table_extended,
+               bool create_category_templates,
+               bool link_por_file)
 {
 #ifdef TIME_CONVERSION
     QElapsedTimer timer;
@@ -3765,7 +4109,7 @@ void toMarkdown(const XmlElement *root_elem,
     create_por_link          = link_por_file;
 
     gumbofilenumber   = 0;
-    collator.setNumericMode(true);
+    html_cache.clear();
 
     imported_date = QDateTime::currentDateTime().toString(QLocale::system().dateTimeFormat());
 
@@ -3777,25 +4121,38 @@ void toMarkdown(const XmlElement *root_elem,
 
     // To help get category for pins on each individual topic,
     // get the topic_id of every single topic in the file.
-    foreach (const auto &topic, root_elem->findChildren<XmlElement*>("topic"))
+    const QList<XmlElement*> all_topics = root_elem->findChildren<XmlElement*>("topic");
+    foreach (const auto &topic, all_topics)
     {
         // Filename contains the FULL topic name including prefix and suffix
         QString fullname;
-        const QString prefix   = topic->attribute("prefix");
-        const QString corename = topic->attribute("public_name");
-        const QString suffix   = topic->attribute("suffix");
+        const QString prefix   = topic->attribute(XmlElement::KEY_PREFIX);
+        const QString corename = topic->attribute(XmlElement::KEY_PUBLIC_NAME);
+        const QString suffix   = topic->attribute(XmlElement::KEY_SUFFIX);
 
         if (!prefix.isEmpty()) fullname += prefix + " - ";
         fullname += corename;
         if (!suffix.isEmpty()) fullname += " (" + suffix + ")";
 
-        global_names.insert(topic->attribute("topic_id"), corename);
+        global_names.insert(topic->symbolAttribute(XmlElement::KEY_TOPIC_ID), corename);
         topic_full_name.insert(topic, fullname);
 
         QString vfn = validFilename(fullname);
         if (vfn != fullname) qWarning() << "Filename (" << vfn << ") different for " << fullname;
-        topic_filename.insert(topic->attribute("topic_id"), validFilename(fullname));
+        topic_filename.insert(topic->attribute(XmlElement::KEY_TOPIC_ID), validFilename(fullname));
     }
+    build_link_targets(all_topics);
+    topic_sorter.addTopics(all_topics);
+    build_connection_graph(root_elem);
+    if (create_5e_statblocks || create_statblocks || initiative_tracker) preparePortfolios(root_elem);
+
+    // Create all the folders for the topic files in one pass,
+    // so that writing each individual file doesn't need to check for its folder.
+    make_directory(assetsDir);
+    if (create_category_templates) make_directory(templatesDir);
+    QSet<QString> topic_dirs;
+    for (const auto &target : qAsConst(link_targets)) topic_dirs.insert(target.dirname);
+    for (const auto &dirname : qAsConst(topic_dirs)) make_directory(dirname);
 
     // Write out the individual TOPIC files now:
     // Note use of findChildren to find children at all levels,
@@ -3805,18 +4162,34 @@ void toMarkdown(const XmlElement *root_elem,
     write_separate_index(root_elem);
     write_category_files(root_elem);
 
-    write_relationships(root_elem);
+    write_relationships();
     write_storyboard(root_elem);
 
     // A separate file for every single topic
     write_child_topics(root_elem->findChild<XmlElement*>("contents"));
 
+    // Make sure everything is on the disk before reporting completion.
+    const int failed_files = waitForOutputFiles();
+
 #ifdef TIME_CONVERSION
     qInfo() << "TIME TO GENERATE HTML =" << timer.elapsed() << "milliseconds";
+    qInfo() << "EMBEDDED HTML: converted" << html_cache.misses() << "fragments, reused" << html_cache.hits();
 #endif
 
     // Tidy up memory
     topic_full_name.clear();
     topic_filename.clear();
+    link_targets.clear();
+    topic_sorter.clear();
+    decoded_styles.clear();
+    decoded_style_sheets.clear();
+    html_cache.clear();
+    existing_dirs.clear();
     global_names.clear();
+    topic_text.clear();
+    all_connections.clear();
+    topic_connections.clear();
+    nature_connections.clear();
+    clearPortfolios();
+    return failed_files;
 }
@@ -21,6 +21,8 @@
 #include <QString>
 class XmlElement;
 
+//#define BENCHMARK_DICE
+
 extern const QString map_pin_title_default;
 extern const QString map_pin_description_default;
 extern const QString map_pin_gm_directions_default;
@@ -30,28 +32,32 @@ extern QString map_pin_description;
 extern QString map_pin_gm_directions;
 
 
-void toMarkdown(const XmlElement *root_elem,
-                int  max_image_width,
-                bool create_leaflet_pins,
-                bool use_reveal_mask,
-                bool folders_by_category,
-                bool obsidian_links,
-                bool create_nav_panel,
-                bool tag_for_each_prefix,
-                bool tag_for_each_suffix,
-                bool graph_connections,
-                bool mark_dice_rolls,
-                bool mark_html_dice_rolls,
-                bool do_statblocks,
-                bool do_5e_statblocks,
-                bool add_admonition_gmdir,
-                bool add_adminition_rwstyle,
-                bool add_frontmatter_labeled_text,
-                bool add_frontmatter_numeric,
-                bool add_frontmatter_prefix_suffix,
-                bool add_initiative_tracker,
-                bool permit_table_extended,
-                bool create_category_templates,
-                bool link_por_file);
+int toMarkdown(const XmlElement *root_elem,
+               int  max_image_width,
+               bool create_leaflet_pins,
+               bool use_reveal_mask,
+               bool folders_by_category,
+               bool obsidian_links,
+               bool create_nav_panel,
+               bool tag_for_each_prefix,
+               bool tag_for_each_suffix,
+               bool graph_connections,
+               bool mark_dice_rolls,
+               bool mark_html_dice_rolls,
+               bool do_statblocks,
+               bool do_5e_statblocks,
+               bool add_admonition_gmdir,
+               bool add_adminition_rwstyle,
+               bool add_frontmatter_labeled_text,
+               bool add_frontmatter_numeric,
+               bool add_frontmatter_prefix_suffix,
+               bool add_initiative_tracker,
+               bool permit_table_extended,
+               bool create_category_templates,
+               bool link_por_file);
+
+#ifdef BENCHMARK_DICE
+void benchmarkDice();
+#endif
 
 #endif // OUTPUTMARKDOWN_H
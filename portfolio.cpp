@@ -0,0 +1,178 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "portfolio.h"
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QHash>
+#include <QMutex>
+#include <future>
+#include <thread>
+#include <quazip/quazip.h>
+#include <quazip/quazipfile.h>
+
+#include "xmlelement.h"
+
+//#define PRINT_PORTFOLIO_CACHE
+
+// Indexed by the asset's data (pointer and size), so that a repeated request doesn't hash the archive again.
+typedef QPair<const char*,int> PortfolioKey;
+struct PortfolioEntry
+{
+    QByteArray source;      // keeps the data (and so the key's pointer) valid
+    Portfolio portfolio;
+};
+static QHash<PortfolioKey,PortfolioEntry> portfolio_cache;
+// Indexed by the SHA1 of the archive, so that copies of the same portfolio
+// in different snippets are only decompressed once.
+static QHash<QByteArray,Portfolio> portfolio_by_hash;
+static QMutex portfolio_cache_mutex;
+static bool keep_portfolios = false;     // clearPortfolios does nothing while this is set
+
+
+static Portfolio unzip_portfolio(const QByteArray &zip_data)
+{
+    Portfolio result;
+    QByteArray store = zip_data;
+    QBuffer buffer(&store);
+    QuaZip zip(&buffer);
+    if (!zip.open(QuaZip::mdUnzip)) return result;
+
+    result.valid = true;
+    for (bool more=zip.goToFirstFile(); more; more=zip.goToNextFile())
+    {
+        const QString name = zip.getCurrentFileName();
+        QuaZipFile file(&zip);
+        if (!file.open(QuaZipFile::ReadOnly))
+        {
+            qWarning() << "Failed to open file from zip: " << name;
+            continue;
+        }
+        result.index.insert(name, result.files.size());
+        result.files.append(Portfolio::File{name, file.readAll()});
+    }
+#ifdef PRINT_PORTFOLIO_CACHE
+    qDebug() << "unzip_portfolio: found" << result.files.size() << "files";
+#endif
+    return result;
+}
+
+
+/**
+ * @brief readPortfolio
+ * Returns the decompressed contents of the portfolio.
+ * The result is remembered (until clearPortfolios is called), so each portfolio is only
+ * decompressed once no matter how many snippets contain a copy of it, or how many times it is requested.
+ * @param zip_data the contents of the asset
+ * @return
+ */
+Portfolio readPortfolio(const QByteArray &zip_data)
+{
+    const PortfolioKey key = qMakePair(zip_data.constData(), zip_data.size());
+    {
+        QMutexLocker lock(&portfolio_cache_mutex);
+        auto it = portfolio_cache.constFind(key);
+        if (it != portfolio_cache.constEnd()) return it->portfolio;
+    }
+
+    // The archive is only hashed the first time that this copy of it is requested
+    const QByteArray hash = QCryptographicHash::hash(zip_data, QCryptographicHash::Sha1);
+    {
+        QMutexLocker lock(&portfolio_cache_mutex);
+        auto it = portfolio_by_hash.constFind(hash);
+        if (it != portfolio_by_hash.constEnd())
+        {
+#ifdef PRINT_PORTFOLIO_CACHE
+            qDebug() << "readPortfolio: reusing" << hash.toHex();
+#endif
+            portfolio_cache.insert(key, PortfolioEntry{zip_data, it.value()});
+            return it.value();
+        }
+    }
+    const Portfolio portfolio = unzip_portfolio(zip_data);
+    QMutexLocker lock(&portfolio_cache_mutex);
+    portfolio_by_hash.insert(hash, portfolio);
+    portfolio_cache.insert(key, PortfolioEntry{zip_data, portfolio});
+    return portfolio;
+}
+
+
+/**
+ * @brief preparePortfolios
+ * Decompresses every portfolio within the tree, using several threads,
+ * so that the writers find them already in the cache.
+ * @param root
+ */
+void preparePortfolios(const XmlElement *root)
+{
+    QVector<QByteArray> archives;
+    for (auto snippet : root->findChildren<XmlElement*>("snippet"))
+    {
+        if (snippet->attribute(XmlElement::KEY_TYPE) != "Portfolio") continue;
+        for (auto ext_object : snippet->xmlChildren("ext_object"))
+            for (auto asset : ext_object->xmlChildren("asset"))
+                if (auto contents = asset->xmlChild("contents"))
+                    archives.append(contents->byteData());
+    }
+    if (archives.isEmpty()) return;
+
+    const int max_threads = qMax(1, qMin(archives.size(), int(std::thread::hardware_concurrency())));
+    std::vector<std::future<void>> jobs;
+    for (int first = 0; first < max_threads; first++)
+    {
+        jobs.push_back(std::async(std::launch::async, [&archives,first,max_threads]() {
+            for (int pos = first; pos < archives.size(); pos += max_threads)
+                readPortfolio(archives.at(pos));
+        }));
+    }
+    for (auto &job : jobs) job.get();
+}
+
+
+/**
+ * @brief clearPortfolios
+ * Forget all the decompressed portfolios
+ * (each writer calls this when it has finished, and it is also called when a different file is loaded).
+ * Nothing is forgotten while keepPortfolios is in force.
+ */
+void clearPortfolios()
+{
+    QMutexLocker lock(&portfolio_cache_mutex);
+    if (keep_portfolios) return;
+    portfolio_cache.clear();
+    portfolio_by_hash.clear();
+}
+
+
+/**
+ * @brief keepPortfolios
+ * Used when several formats are written one after the other, so that the portfolios
+ * are only decompressed by the first writer. Clearing the flag forgets all the portfolios.
+ * @param keep true if clearPortfolios should be ignored until this is called again with false
+ */
+void keepPortfolios(bool keep)
+{
+    {
+        QMutexLocker lock(&portfolio_cache_mutex);
+        keep_portfolios = keep;
+    }
+    if (!keep) clearPortfolios();
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef PORTFOLIO_H
+#define PORTFOLIO_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+class XmlElement;
+
+/**
+ * @brief The Portfolio struct
+ * The decompressed contents of a Hero Lab portfolio (a zip file stored in a Portfolio snippet).
+ * Each archive is only decompressed once, and the result is shared by every writer that asks for it.
+ */
+struct Portfolio
+{
+    struct File
+    {
+        QString    name;        // path within the archive, e.g. "statblocks_html/1_Name.htm"
+        QByteArray data;
+    };
+    QVector<File> files;        // in the order in which they are stored in the archive
+    QHash<QString,int> index;   // position of each file within files
+    bool valid{false};          // false if the data isn't a zip file
+
+    bool contains(const QString &name) const { return index.contains(name); }
+    QByteArray file(const QString &name) const
+    {
+        auto it = index.constFind(name);
+        return (it != index.constEnd()) ? files.at(it.value()).data : QByteArray();
+    }
+};
+
+Portfolio readPortfolio(const QByteArray &zip_data);
+void preparePortfolios(const XmlElement *root);
+void clearPortfolios();
+void keepPortfolios(bool keep);
+
+#endif // PORTFOLIO_H
@@ -0,0 +1,85 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef RENDERCACHE_H
+#define RENDERCACHE_H
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+/**
+ * @brief The RenderCache class
+ * Remembers the converted form of embedded HTML (statblocks and rich text fragments), keyed by
+ * a hash of the source data and of the options which affect the conversion, so that a fragment
+ * which appears in many topics is only converted once.
+ * The counters show how much work has been saved.
+ */
+template<class T>
+class RenderCache
+{
+public:
+    static QByteArray key(const QByteArray &data, const QString &options)
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(options.toUtf8());
+        hash.addData(data);
+        return hash.result();
+    }
+
+    bool find(const QByteArray &key, T &result)
+    {
+        QMutexLocker lock(&mutex);
+        auto it = cache.constFind(key);
+        if (it == cache.constEnd())
+        {
+            ++p_misses;
+            return false;
+        }
+        ++p_hits;
+        result = it.value();
+        return true;
+    }
+
+    void insert(const QByteArray &key, const T &result)
+    {
+        QMutexLocker lock(&mutex);
+        cache.insert(key, result);
+    }
+
+    void clear()
+    {
+        QMutexLocker lock(&mutex);
+        cache.clear();
+        p_hits = p_misses = 0;
+    }
+
+    int hits() const   { return p_hits; }
+    int misses() const { return p_misses; }
+
+private:
+    QMutex mutex;
+    QHash<QByteArray,T> cache;
+    int p_hits{0};
+    int p_misses{0};
+};
+
+#endif // RENDERCACHE_H
@@ -0,0 +1,68 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef SYMBOLTABLE_H
+#define SYMBOLTABLE_H
+
+#include <QString>
+#include <QVector>
+#include "xmlelement.h"
+
+/**
+ * @brief The SymbolTable class
+ * Maps Realm Works IDs to values, using the dense integer that XmlElement assigns to each ID
+ * as an index into an array. Looking up an ID that is already known is array indexing, and once
+ * the table has been filled it can be read from several threads without locking.
+ * Entries are only inserted by SymbolId (from symbolAttribute), since new IDs are only
+ * registered while the tree is being read.
+ */
+template<class T>
+class SymbolTable
+{
+public:
+    void insert(XmlElement::SymbolId id, const T &value)
+    {
+        if (id < 0) return;
+        if (id >= p_values.size())
+        {
+            p_values.resize(qMax(id + 1, XmlElement::symbolCount()));
+            p_present.resize(p_values.size());
+        }
+        p_values[id]  = value;
+        p_present[id] = true;
+    }
+
+    bool contains(XmlElement::SymbolId id) const { return id >= 0 && id < p_present.size() && p_present.at(id); }
+    bool contains(const QString &id) const { return contains(XmlElement::findSymbol(id)); }
+
+    const T &value(XmlElement::SymbolId id) const
+    {
+        static const T default_value = T();
+        return contains(id) ? p_values.at(id) : default_value;
+    }
+    const T &value(const QString &id) const { return value(XmlElement::findSymbol(id)); }
+
+    void clear() { p_values.clear(); p_present.clear(); }
+
+private:
+    QVector<T> p_values;
+    QVector<bool> p_present;
+};
+
+#endif // SYMBOLTABLE_H
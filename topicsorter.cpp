@@ -0,0 +1,82 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "topicsorter.h"
+
+#include "xmlelement.h"
+
+
+TopicSorter::TopicSorter(NameFunction topic_name) :
+    topic_name(topic_name)
+{
+    // allow alphanumeric sorting to do proper number comparisons
+    collator.setNumericMode(true);
+}
+
+
+TopicSorter::Key TopicSorter::makeKey(const XmlElement *topic) const
+{
+    const QString &prefix = topic->attribute(XmlElement::KEY_PREFIX);
+    return Key{ !prefix.isEmpty(),
+                collator.sortKey(prefix),
+                collator.sortKey(topic_name ? topic_name(topic) : topic->attribute(XmlElement::KEY_PUBLIC_NAME)) };
+}
+
+
+/**
+ * @brief TopicSorter::addTopics
+ * Creates the collation key for each of the topics.
+ * @param topics
+ */
+void TopicSorter::addTopics(const QList<XmlElement*> &topics)
+{
+    index.reserve(index.size() + topics.size());
+    keys.reserve(keys.size() + topics.size());
+    for (auto topic : topics)
+    {
+        if (index.contains(topic)) continue;
+        index.insert(topic, int(keys.size()));
+        keys.push_back(makeKey(topic));
+    }
+}
+
+
+void TopicSorter::clear()
+{
+    index.clear();
+    keys.clear();
+}
+
+
+// Sort topics, first by prefix, and then by topic name
+bool TopicSorter::lessThan(const Key &left, const Key &right, bool sort_by_prefix)
+{
+    if (sort_by_prefix)
+    {
+        // items with prefix come before items without prefix
+        if (left.has_prefix != right.has_prefix) return left.has_prefix;
+        if (left.has_prefix)
+        {
+            int cmp = left.prefix.compare(right.prefix);
+            if (cmp != 0) return cmp < 0;
+        }
+    }
+    // Both have the same prefix
+    return left.name.compare(right.name) < 0;
+}
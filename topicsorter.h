@@ -0,0 +1,92 @@
+/*
+ * This file is part of the RWout (https://github.com/farling42/RWoutput).
+ * Copyright (c) 2018 Martin Smith.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef TOPICSORTER_H
+#define TOPICSORTER_H
+
+#include <QCollator>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+class XmlElement;
+
+/**
+ * @brief The TopicSorter class
+ * Orders topics by prefix (topics with a prefix first) and then by name,
+ * using a numeric collator so that "Room 2" comes before "Room 10".
+ *
+ * The collation key of every topic is created once by addTopics,
+ * so each sort only needs to compare the binary keys.
+ * Once the keys have been added, sort can safely be called from several threads at once.
+ */
+class TopicSorter
+{
+public:
+    typedef std::function<QString(const XmlElement*)> NameFunction;
+    TopicSorter(NameFunction topic_name = NameFunction());
+
+    void addTopics(const QList<XmlElement*> &topics);
+    void clear();
+
+    template<class T>
+    void sort(QList<T*> &topics, bool sort_by_prefix) const
+    {
+        if (topics.size() < 2) return;
+        std::vector<std::pair<const Key*,T*>> order;
+        std::vector<Key> missing;
+        missing.reserve(topics.size());     // so that pointers into it remain valid
+        order.reserve(topics.size());
+        for (auto topic : topics)
+        {
+            auto it = index.constFind(topic);
+            if (it != index.constEnd())
+                order.emplace_back(&keys.at(it.value()), topic);
+            else
+            {
+                missing.push_back(makeKey(topic));
+                order.emplace_back(&missing.back(), topic);
+            }
+        }
+        std::stable_sort(order.begin(), order.end(),
+                  [sort_by_prefix](const std::pair<const Key*,T*> &left, const std::pair<const Key*,T*> &right)
+        { return lessThan(*left.first, *right.first, sort_by_prefix); });
+        for (int i = 0; i < topics.size(); i++) topics[i] = order[i].second;
+    }
+
+private:
+    struct Key
+    {
+        bool has_prefix;
+        QCollatorSortKey prefix;
+        QCollatorSortKey name;
+    };
+    Key makeKey(const XmlElement *topic) const;
+    static bool lessThan(const Key &left, const Key &right, bool sort_by_prefix);
+
+    QCollator collator;
+    NameFunction topic_name;
+    QHash<const XmlElement*,int> index;     // position of each topic's key within keys
+    std::vector<Key> keys;
+};
+
+#endif // TOPICSORTER_H
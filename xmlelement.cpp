@@ -19,11 +19,17 @@
 
 #include <QDebug>
 #include <QElapsedTimer>
+#include <QHash>
+#include <QThread>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include "gumbo.h"
 
 //#define DUMP_LOADED_TREE
 //#define PRINT_XMLELEMENT_CONSTRUCTOR
 //#define PRINT_GUMBO
+//#define PRINT_SIMPLE_HTML
 #define PRINT_LOAD_TIME
 
 static int dump_indentation = 0;
@@ -75,6 +81,24 @@ XmlElement::XmlElement(const GumboNode *node, QObject *parent) :
     }
 }
 
+/**
+ * @brief XmlElement::XmlElement
+ * Creates an XmlElement for one element found by parse_simple_html
+ * @param tag the lower-case name of the HTML element
+ * @param attributes
+ * @param parent
+ */
+XmlElement::XmlElement(const QString &tag, const QVector<Attribute> &attributes, QObject *parent) :
+    QObject(parent),
+    p_attributes(attributes)
+{
+    setObjectName(tag);
+
+#ifdef PRINT_XMLELEMENT_CONSTRUCTOR
+    qDebug().noquote().nospace() << "XmlElement(simple)    <" << objectName() << ">";
+#endif
+}
+
 /**
  * @brief XmlElement::XmlElement
  * Read the next XML element from the RW export file
@@ -95,7 +119,7 @@ XmlElement::XmlElement(QXmlStreamReader *reader, QObject *parent) :
     // Collect up all the attributes
     const QXmlStreamAttributes attributes{reader->attributes()};
     p_attributes.reserve(attributes.size());
-    for (auto attr : attributes)
+    for (const auto &attr : attributes)
         p_attributes.append(Attribute(attr.name(), attr.value()));
 
     // Now read the rest of this element
@@ -105,6 +129,12 @@ XmlElement::XmlElement(QXmlStreamReader *reader, QObject *parent) :
         {
         case QXmlStreamReader::StartElement:
             //qDebug().noquote() << "StartElement:" << reader->name();
+            if (p_html_pending)
+            {
+                // Keep the earlier HTML in order, and leave the mixed content permanently translated.
+                translate();
+                p_html_source.clear();
+            }
             // The start of a child
             new XmlElement(reader, this);
             break;
@@ -144,38 +174,20 @@ XmlElement::XmlElement(QXmlStreamReader *reader, QObject *parent) :
                 }
                 else if (translate_html && text.left(1) == "<")
                 {
-                    qDebug() << "Converting GUMBO";
-                    //
-                    // Use the GUMBO library to parse the HTML5 code.
-                    //
-                    // It uses pointers into the original data, so we have to store
-                    // the QByteArray until gumbo_destroy_output is called.
-                    //
-                    QByteArray buffer(text.toUtf8());
-                    GumboOutput *output = gumbo_parse(buffer);
-                    // The output will be
-                    // <html>
-                    //   <head/>
-                    //   <body>
-                    //     the nodes that we want
-#ifdef PRINT_GUMBO
-                    qDebug() << "---GUMBO start---";
-#endif
-                    // Check that HTML has at least 2 children: head and body
-                    if (output->root->v.element.children.length >= 2)
-                    {
-                        const GumboNode *body_node = reinterpret_cast<GumboNode*>(output->root->v.element.children.data[1]);
-                        parse_gumbo_nodes(body_node);
-                    }
-#ifdef PRINT_GUMBO
-                    qDebug() << "---GUMBO finish---";
-#endif
-                    // Get GUMBO to release all the memory
-                    gumbo_destroy_output(&kGumboDefaultOptions, output);
+                    // Keep the HTML as it is, it will be converted by GUMBO
+                    // only if something asks for the children of this element.
+                    p_html_source.append(text.toUtf8());
+                    p_html_pending = true;
                 }
                 else
                 {
-                    new XmlElement(text.toString().toUtf8(), this);
+                    if (p_html_pending)
+                    {
+                        // Keep the earlier HTML in order, and leave the mixed content permanently translated.
+                        translate();
+                        p_html_source.clear();
+                    }
+                    new XmlElement(text.toUtf8(), this);
                 }
             }
             break;
@@ -209,6 +221,412 @@ XmlElement::XmlElement(QXmlStreamReader *reader, QObject *parent) :
     }
 }
 
+/*
+ * The subset of HTML which Realm Works puts into snippets.
+ */
+
+enum SimpleTagKind {
+    SIMPLE_PHRASING = 1,        // span, b, i, ...
+    SIMPLE_VOID     = 2,        // has no children and no end tag
+    SIMPLE_BLOCK    = 4,        // closes any open <p> (so only accepted when there isn't one)
+    SIMPLE_HEADING  = 8,
+    SIMPLE_SPECIAL  = 16,       // limits the search for an open <li>
+    SIMPLE_TABLE    = 32,       // only text which is whitespace is allowed directly inside
+    SIMPLE_SECTION  = 64,       // tbody, thead, tfoot
+    SIMPLE_CELL     = 128,      // td, th
+    SIMPLE_SCOPE    = 256       // limits the search for an open <p>
+};
+
+static int simple_tag_kind(const QByteArray &tag)
+{
+    static const QHash<QByteArray,int> kinds{
+        { "span",   SIMPLE_PHRASING },
+        { "b",      SIMPLE_PHRASING },
+        { "i",      SIMPLE_PHRASING },
+        { "u",      SIMPLE_PHRASING },
+        { "s",      SIMPLE_PHRASING },
+        { "em",     SIMPLE_PHRASING },
+        { "strong", SIMPLE_PHRASING },
+        { "sup",    SIMPLE_PHRASING },
+        { "sub",    SIMPLE_PHRASING },
+        { "a",      SIMPLE_PHRASING },
+        { "br",     SIMPLE_PHRASING | SIMPLE_VOID },
+        { "p",      SIMPLE_BLOCK },
+        { "div",    SIMPLE_BLOCK },
+        { "ul",     SIMPLE_BLOCK | SIMPLE_SPECIAL },
+        { "ol",     SIMPLE_BLOCK | SIMPLE_SPECIAL },
+        { "li",     SIMPLE_BLOCK | SIMPLE_SPECIAL },
+        { "h1",     SIMPLE_BLOCK | SIMPLE_SPECIAL | SIMPLE_HEADING },
+        { "h2",     SIMPLE_BLOCK | SIMPLE_SPECIAL | SIMPLE_HEADING },
+        { "h3",     SIMPLE_BLOCK | SIMPLE_SPECIAL | SIMPLE_HEADING },
+        { "h4",     SIMPLE_BLOCK | SIMPLE_SPECIAL | SIMPLE_HEADING },
+        { "h5",     SIMPLE_BLOCK | SIMPLE_SPECIAL | SIMPLE_HEADING },
+        { "h6",     SIMPLE_BLOCK | SIMPLE_SPECIAL | SIMPLE_HEADING },
+        { "table",  SIMPLE_BLOCK | SIMPLE_SPECIAL | SIMPLE_TABLE | SIMPLE_SCOPE },
+        { "tbody",  SIMPLE_SPECIAL | SIMPLE_TABLE | SIMPLE_SECTION },
+        { "thead",  SIMPLE_SPECIAL | SIMPLE_TABLE | SIMPLE_SECTION },
+        { "tfoot",  SIMPLE_SPECIAL | SIMPLE_TABLE | SIMPLE_SECTION },
+        { "tr",     SIMPLE_SPECIAL | SIMPLE_TABLE },
+        { "td",     SIMPLE_SPECIAL | SIMPLE_CELL | SIMPLE_SCOPE },
+        { "th",     SIMPLE_SPECIAL | SIMPLE_CELL | SIMPLE_SCOPE },
+    };
+    return kinds.value(tag, 0);
+}
+
+static inline bool is_html_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\f';
+}
+
+static inline bool is_ascii_alnum(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9');
+}
+
+static void append_utf8(QByteArray &result, uint code)
+{
+    if (code < 0x80)
+        result.append(char(code));
+    else if (code < 0x800)
+    {
+        result.append(char(0xC0 | (code >> 6)));
+        result.append(char(0x80 | (code & 0x3F)));
+    }
+    else if (code < 0x10000)
+    {
+        result.append(char(0xE0 | (code >> 12)));
+        result.append(char(0x80 | ((code >> 6) & 0x3F)));
+        result.append(char(0x80 | (code & 0x3F)));
+    }
+    else
+    {
+        result.append(char(0xF0 | (code >> 18)));
+        result.append(char(0x80 | ((code >> 12) & 0x3F)));
+        result.append(char(0x80 | ((code >> 6) & 0x3F)));
+        result.append(char(0x80 | (code & 0x3F)));
+    }
+}
+
+/**
+ * @brief decode_simple_text
+ * Replaces the character references in the text between begin and end.
+ * Only the references which Realm Works generates are handled, anything else is rejected
+ * (as are the characters which an HTML5 parser would silently change).
+ * @param begin
+ * @param end
+ * @param result set to the UTF-8 text
+ * @return false if the text can't be handled without GUMBO
+ */
+static bool decode_simple_text(const char *begin, const char *end, QByteArray &result)
+{
+    result.clear();
+    result.reserve(int(end - begin));
+    for (const char *pos = begin; pos < end; )
+    {
+        const char *amp = static_cast<const char*>(memchr(pos, '&', size_t(end - pos)));
+        if (amp == nullptr) amp = end;
+        for (const char *ch = pos; ch < amp; ++ch)
+            if (*ch == '\0' || *ch == '\r') return false;
+        result.append(pos, int(amp - pos));
+        if (amp == end) break;
+
+        const char *semicolon = static_cast<const char*>(memchr(amp, ';', size_t(end - amp)));
+        if (semicolon == nullptr || semicolon - amp > 10) return false;
+        const QByteArray name = QByteArray::fromRawData(amp + 1, int(semicolon - amp - 1));
+        uint code = 0;
+        if (name.startsWith('#'))
+        {
+            bool ok;
+            const bool hex = name.size() > 1 && (name.at(1) == 'x' || name.at(1) == 'X');
+            const QByteArray digits = name.mid(hex ? 2 : 1);
+            if (digits.isEmpty() || !std::all_of(digits.begin(), digits.end(), [hex](char ch) { return isxdigit(uchar(ch)) && (hex || isdigit(uchar(ch))); }))
+                return false;
+            code = digits.toUInt(&ok, hex ? 16 : 10);
+            // Only accept characters that aren't remapped by the HTML5 parser
+            if (!ok || !(code == '\t' || code == '\n' ||
+                         (code >= 0x20    && code <= 0x7E) ||
+                         (code >= 0xA0    && code <= 0xD7FF) ||
+                         (code >= 0xE000  && code <= 0xFDCF) ||
+                         (code >= 0xFDF0  && code <= 0xFFFD) ||
+                         (code >= 0x10000 && code <= 0x10FFFD && (code & 0xFFFE) != 0xFFFE)))
+                return false;
+        }
+        else if (name == "amp")  code = '&';
+        else if (name == "lt")   code = '<';
+        else if (name == "gt")   code = '>';
+        else if (name == "quot") code = '"';
+        else if (name == "apos") code = '\'';
+        else if (name == "nbsp") code = 0xA0;
+        else
+            return false;
+        append_utf8(result, code);
+        pos = semicolon + 1;
+    }
+    return true;
+}
+
+/**
+ * @brief XmlElement::parse_simple_html
+ * Converts the HTML into child XmlElements without using GUMBO.
+ * Only the simple, well-formed HTML which Realm Works generates for snippets is accepted;
+ * for that HTML the children are the same as those which parse_gumbo_nodes would create.
+ * Anything which an HTML5 parser might restructure (unclosed or mismatched tags, <style>,
+ * comments, implied closing of paragraphs, etc.) is rejected, so that GUMBO can be used instead.
+ * @param source the HTML
+ * @return true if the children have been created, false if nothing was changed.
+ */
+
+bool XmlElement::parse_simple_html(const QByteArray &source)
+{
+    struct OpenElement {
+        XmlElement *element;
+        QByteArray tag;
+        int kind;
+    };
+    QVector<OpenElement> stack;
+    QList<XmlElement*> created;     // direct children created here
+    bool in_body = false;           // an HTML5 parser ignores leading whitespace
+    QByteArray text;
+
+    auto reject = [&created]() {
+        qDeleteAll(created);
+        return false;
+    };
+    auto current = [this,&stack]() -> XmlElement* {
+        return stack.isEmpty() ? this : stack.last().element;
+    };
+    auto current_kind = [&stack]() {
+        return stack.isEmpty() ? 0 : stack.last().kind;
+    };
+    auto add_child = [&](XmlElement *child) {
+        if (stack.isEmpty()) created.append(child);
+        in_body = true;
+    };
+
+    const char *pos = source.constData();
+    const char *const end = pos + source.size();
+    while (pos < end)
+    {
+        // Text up to the next tag
+        const char *tag_start = static_cast<const char*>(memchr(pos, '<', size_t(end - pos)));
+        if (tag_start == nullptr) tag_start = end;
+        if (tag_start > pos)
+        {
+            if (!decode_simple_text(pos, tag_start, text)) return reject();
+            const bool whitespace = std::all_of(text.begin(), text.end(), is_html_space);
+            // Text directly inside a table would be moved outside the table
+            if (!whitespace && (current_kind() & SIMPLE_TABLE)) return reject();
+            if (!in_body)
+            {
+                int skip = 0;
+                while (skip < text.size() && is_html_space(text.at(skip))) skip++;
+                text.remove(0, skip);
+            }
+            if (!text.isEmpty()) add_child(new XmlElement(text, current()));
+        }
+        if (tag_start == end) break;
+
+        // The tag name
+        pos = tag_start + 1;
+        const bool closing = pos < end && *pos == '/';
+        if (closing) pos++;
+        const char *name_start = pos;
+        while (pos < end && is_ascii_alnum(*pos)) pos++;
+        if (pos == name_start || isdigit(uchar(*name_start))) return reject();
+        if (pos < end && !is_html_space(*pos) && *pos != '>' && *pos != '/') return reject();
+        const QByteArray tag = QByteArray(name_start, int(pos - name_start)).toLower();
+        const int kind = simple_tag_kind(tag);
+        if (kind == 0) return reject();
+
+        // The attributes
+        QVector<Attribute> attributes;
+        bool self_closing = false;
+        forever
+        {
+            while (pos < end && is_html_space(*pos)) pos++;
+            if (pos == end) return reject();
+            if (*pos == '>')
+            {
+                pos++;
+                break;
+            }
+            if (*pos == '/')
+            {
+                if (pos + 1 == end || pos[1] != '>') return reject();
+                self_closing = true;
+                pos += 2;
+                break;
+            }
+            if (closing) return reject();
+
+            const char *attr_start = pos;
+            while (pos < end && (is_ascii_alnum(*pos) || *pos == '-' || *pos == '_' || *pos == ':')) pos++;
+            if (pos == attr_start) return reject();
+            const QString name = QString::fromLatin1(attr_start, int(pos - attr_start)).toLower();
+            QByteArray value;
+            while (pos < end && is_html_space(*pos)) pos++;
+            if (pos < end && *pos == '=')
+            {
+                pos++;
+                while (pos < end && is_html_space(*pos)) pos++;
+                // Only quoted values are accepted
+                if (pos == end || (*pos != '"' && *pos != '\'')) return reject();
+                const char quote = *pos++;
+                const char *value_end = static_cast<const char*>(memchr(pos, quote, size_t(end - pos)));
+                if (value_end == nullptr || !decode_simple_text(pos, value_end, value)) return reject();
+                pos = value_end + 1;
+                if (pos < end && !is_html_space(*pos) && *pos != '>' && *pos != '/') return reject();
+            }
+            for (const auto &attr : attributes)
+                if (attr.name == name) return reject();
+            attributes.append(Attribute(name, QString::fromUtf8(value)));
+        }
+
+        if (closing)
+        {
+            if (self_closing || (kind & SIMPLE_VOID)) return reject();
+            // </table> also closes a table section
+            if (tag == "table" && (current_kind() & SIMPLE_SECTION)) stack.removeLast();
+            if (stack.isEmpty() || stack.last().tag != tag) return reject();
+            stack.removeLast();
+            continue;
+        }
+        if (self_closing && !(kind & SIMPLE_VOID)) return reject();
+
+        // Only table parts in the correct place are accepted inside a table
+        const QByteArray parent_tag = stack.isEmpty() ? QByteArray() : stack.last().tag;
+        bool implied_tbody = false;
+        if (current_kind() & SIMPLE_TABLE)
+        {
+            if (parent_tag == "table")
+            {
+                if (tag == "tr")
+                    implied_tbody = true;
+                else if (!(kind & SIMPLE_SECTION))
+                    return reject();
+            }
+            else if (parent_tag == "tr")
+            {
+                if (!(kind & SIMPLE_CELL)) return reject();
+            }
+            else if (tag != "tr")
+                return reject();
+        }
+        else if ((kind & (SIMPLE_SECTION | SIMPLE_CELL)) || tag == "tr")
+            return reject();
+
+        // Elements which would cause an open element to be closed
+        for (int i = stack.size() - 1; i >= 0; --i)
+        {
+            const OpenElement &open = stack.at(i);
+            if ((kind & SIMPLE_BLOCK) && open.tag == "p") return reject();
+            if (tag == "li" && open.tag == "li") return reject();
+            if (tag == "a" && open.tag == "a") return reject();
+            if ((kind & SIMPLE_HEADING) && i == stack.size() - 1 && (open.kind & SIMPLE_HEADING)) return reject();
+            // <table> and its cells limit the search for <p>, other special elements limit the search for <li>
+            if ((open.kind & SIMPLE_SCOPE) && tag != "li" && tag != "a") break;
+            if ((open.kind & SIMPLE_SPECIAL) && tag == "li") break;
+        }
+
+        if (implied_tbody)
+        {
+            XmlElement *tbody = new XmlElement(QStringLiteral("tbody"), QVector<Attribute>(), current());
+            stack.append(OpenElement{tbody, "tbody", simple_tag_kind("tbody")});
+        }
+        XmlElement *element = new XmlElement(QString::fromLatin1(tag), attributes, current());
+        add_child(element);
+        if (!(kind & SIMPLE_VOID)) stack.append(OpenElement{element, tag, kind});
+    }
+
+    // Unclosed elements are left for GUMBO
+    if (!stack.isEmpty()) return reject();
+    return true;
+}
+
+/**
+ * @brief XmlElement::translate_html_source
+ * Use the GUMBO library to convert the HTML5 stored with this element into child XmlElements.
+ */
+
+void XmlElement::translate_html_source()
+{
+    // The tree is not locked, so translation must not be started by a worker thread (see translateAll).
+    Q_ASSERT(QThread::currentThread() == thread());
+    p_html_pending = false;
+    // The HTML always follows any XML children (later content makes the translation permanent),
+    // so the translated children are those added from here on.
+    p_first_translated = children().size();
+#ifdef PRINT_GUMBO
+    qDebug() << "Converting GUMBO";
+#endif
+    // p_html_source is kept, so that the children can be recreated after releaseTranslations.
+    // Most snippets only use a small, well-formed subset of HTML, which can be read without GUMBO.
+    if (parse_simple_html(p_html_source)) return;
+#ifdef PRINT_SIMPLE_HTML
+    qDebug() << "Simple HTML rejected:" << p_html_source;
+#endif
+
+    GumboOutput *output = gumbo_parse(p_html_source);
+    // The output will be
+    // <html>
+    //   <head/>
+    //   <body>
+    //     the nodes that we want
+#ifdef PRINT_GUMBO
+    qDebug() << "---GUMBO start---";
+#endif
+    // Check that HTML has at least 2 children: head and body
+    if (output->root->v.element.children.length >= 2)
+    {
+        const GumboNode *body_node = reinterpret_cast<GumboNode*>(output->root->v.element.children.data[1]);
+        parse_gumbo_nodes(body_node);
+    }
+#ifdef PRINT_GUMBO
+    qDebug() << "---GUMBO finish---";
+#endif
+    // Get GUMBO to release all the memory
+    gumbo_destroy_output(&kGumboDefaultOptions, output);
+}
+
+/**
+ * @brief XmlElement::releaseTranslations
+ * Delete the child elements that were created from embedded HTML within this part of the tree,
+ * so that the memory is returned once a writer has finished with them.
+ * They will be created again if they are subsequently requested.
+ * Any pointers to those child elements become invalid.
+ */
+
+void XmlElement::releaseTranslations()
+{
+    if (!p_html_source.isEmpty())
+    {
+        if (!p_html_pending)
+        {
+            // Only delete the children that were created by the translation
+            const QObjectList translated = children().mid(p_first_translated);
+            qDeleteAll(translated);
+            p_html_pending = true;
+        }
+        return;
+    }
+    for (auto child : findChildren<XmlElement*>(QString(), Qt::FindDirectChildrenOnly))
+        child->releaseTranslations();
+}
+
+
+/**
+ * @brief XmlElement::translateAll
+ * Converts all of the embedded HTML within this part of the tree into child elements.
+ * The translation is otherwise done when the children are first requested, which is not thread-safe,
+ * so this must be called before several threads read the same part of the tree.
+ */
+void XmlElement::translateAll() const
+{
+    translate();
+    for (auto child : findChildren<XmlElement*>(QString(), Qt::FindDirectChildrenOnly))
+        child->translateAll();
+}
+
 /**
  * @brief XmlElement::create_children_from_gumbo
  * Read all the GUMBO nodes, looking for TEXT and ELEMENT nodes to convert to XmlElements.
@@ -327,11 +745,11 @@ void XmlElement::dump_tree() const
     {
         // A proper XML element
         QString line = "<" + objectName();
-        for (auto iter : p_attributes)
+        for (const auto &iter : p_attributes)
         {
             line.append(" " + iter.name + "=\"" + iter.value + "\"");
         }
-        QList<XmlElement*> child_items = findChildren<XmlElement*>(QString(), Qt::FindDirectChildrenOnly);
+        QList<XmlElement*> child_items = xmlChildren();
 
         if (child_items.count() == 0 && byteData().isEmpty())
         {
@@ -369,36 +787,190 @@ void XmlElement::dump_tree() const
 QString XmlElement::childString() const
 {
     // 20,092 + 20,466 + 20,289 ms for 900 MB data
-    for (auto child : xmlChildren())
+    return QString::fromUtf8(childBytes());
+}
+
+/**
+ * @brief XmlElement::childBytes
+ * As childString, but returns the UTF-8 text as stored, without any conversion.
+ * @return
+ */
+const QByteArray &XmlElement::childBytes() const
+{
+    translate();
+    for (const QObject *child : children())
     {
-        if (child->isFixedString())
+        const XmlElement *elem = qobject_cast<const XmlElement*>(child);
+        if (elem && elem->isFixedString())
         {
-            return child->fixedText();
+            return elem->p_byte_data;
         }
     }
-    return QString();
+    static const QByteArray empty_bytes;
+    return empty_bytes;
+}
+
+
+static QHash<QString,XmlElement::AttributeKey> &attribute_keys()
+{
+    static QHash<QString,XmlElement::AttributeKey> keys;
+    return keys;
+}
+
+/**
+ * @brief XmlElement::attributeKey
+ * Returns the interned key for the attribute called name, allocating a new key
+ * the first time that a name is seen.
+ * (Registering a new name is not thread-safe, so it is only done while elements are being created.)
+ * @param name
+ * @return
+ */
+XmlElement::AttributeKey XmlElement::attributeKey(const QString &name)
+{
+    QHash<QString,AttributeKey> &keys = attribute_keys();
+    auto it = keys.constFind(name);
+    if (it != keys.constEnd()) return it.value();
+    const AttributeKey key = keys.size();
+    keys.insert(name, key);
+    return key;
+}
+
+
+/**
+ * @brief XmlElement::findAttributeKey
+ * Returns the interned key for the attribute called name, without registering a new one.
+ * @param name
+ * @return -1 if no element has an attribute with that name
+ */
+XmlElement::AttributeKey XmlElement::findAttributeKey(const QString &name)
+{
+    return attribute_keys().value(name, -1);
+}
+
+const XmlElement::AttributeKey XmlElement::KEY_TOPIC_ID    = XmlElement::attributeKey("topic_id");
+const XmlElement::AttributeKey XmlElement::KEY_CATEGORY_ID = XmlElement::attributeKey("category_id");
+const XmlElement::AttributeKey XmlElement::KEY_PREFIX      = XmlElement::attributeKey("prefix");
+const XmlElement::AttributeKey XmlElement::KEY_SUFFIX      = XmlElement::attributeKey("suffix");
+const XmlElement::AttributeKey XmlElement::KEY_PUBLIC_NAME = XmlElement::attributeKey("public_name");
+const XmlElement::AttributeKey XmlElement::KEY_TYPE        = XmlElement::attributeKey("type");
+const XmlElement::AttributeKey XmlElement::KEY_STYLE       = XmlElement::attributeKey("style");
+
+
+static QHash<QString,XmlElement::SymbolId> symbol_ids;
+
+/**
+ * @brief XmlElement::symbolId
+ * Returns the dense integer for the Realm Works ID, allocating a new one the first time that the ID is seen.
+ * (Registering a new ID is not thread-safe, so it is only done while the file is being read.)
+ * @param id
+ * @return -1 for an empty ID
+ */
+XmlElement::SymbolId XmlElement::symbolId(const QString &id)
+{
+    if (id.isEmpty()) return -1;
+    auto it = symbol_ids.constFind(id);
+    if (it != symbol_ids.constEnd()) return it.value();
+    const SymbolId symbol = symbol_ids.size();
+    symbol_ids.insert(id, symbol);
+    return symbol;
+}
+
+
+/**
+ * @brief XmlElement::findSymbol
+ * Returns the dense integer for the Realm Works ID, without registering a new one.
+ * @param id
+ * @return -1 if the ID has not been seen
+ */
+XmlElement::SymbolId XmlElement::findSymbol(const QString &id)
+{
+    return symbol_ids.value(id, -1);
+}
+
+
+int XmlElement::symbolCount()
+{
+    return symbol_ids.size();
 }
 
 
-bool XmlElement::hasAttribute(const QString &name) const
+/**
+ * @brief XmlElement::clearSymbols
+ * Forget all the Realm Works IDs (for use when a different file is loaded,
+ * once the old tree and every SymbolTable indexed by its IDs have been cleared).
+ */
+void XmlElement::clearSymbols()
 {
-    for (auto attr : p_attributes)
-        if (attr.name == name) return true;
-    return false;
+    symbol_ids.clear();
+    symbol_ids.squeeze();
 }
 
 
-const QString &XmlElement::attribute(const QString &name) const
+void XmlElement::Attribute::parse_symbol()
 {
+    if (name.endsWith(QLatin1String("_id"))) symbol = symbolId(value);
+}
+
+
+void XmlElement::Attribute::parse_int()
+{
+    // Only try the conversion when the value looks like a number.
+    if (value.isEmpty()) return;
+    const QChar first = value.at(0);
+    if (first.isDigit() || first == '-' || first == '+')
+        int_value = value.toInt(&is_int);
+}
+
+
+const XmlElement::Attribute *XmlElement::findAttribute(AttributeKey key) const
+{
+    if (key < 0) return nullptr;
     for (const Attribute &attr : p_attributes)
-        if (attr.name == name) return attr.value;
+        if (attr.key == key) return &attr;
+    return nullptr;
+}
+
+
+const QString &XmlElement::attribute(AttributeKey key) const
+{
+    if (const Attribute *attr = findAttribute(key)) return attr->value;
     // Return reference to a null string
     static const QString null_string;
     return null_string;
 }
 
 
+/**
+ * @brief XmlElement::intAttribute
+ * Returns the integer value of the attribute, which was decoded when the attribute was read.
+ * @param key
+ * @param default_value returned if the attribute is missing or not an integer
+ * @return
+ */
+int XmlElement::intAttribute(AttributeKey key, int default_value) const
+{
+    const Attribute *attr = findAttribute(key);
+    return (attr && attr->is_int) ? attr->int_value : default_value;
+}
+
+
+/**
+ * @brief XmlElement::symbolAttribute
+ * Returns the interned value of an "*_id" attribute.
+ * @param key
+ * @return -1 if the attribute is missing (or isn't an ID)
+ */
+XmlElement::SymbolId XmlElement::symbolAttribute(AttributeKey key) const
+{
+    const Attribute *attr = findAttribute(key);
+    return attr ? attr->symbol : -1;
+}
+
+
 QString XmlElement::snippetName() const
 {
-    return hasAttribute("facet_name") ? attribute("facet_name") : attribute("label");
+    static const AttributeKey facet_name = attributeKey("facet_name");
+    static const AttributeKey label      = attributeKey("label");
+    const Attribute *attr = findAttribute(facet_name);
+    return attr ? attr->value : attribute(label);
 }
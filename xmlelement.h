@@ -31,40 +31,97 @@ class XmlElement : public QObject
 public:
     static XmlElement *readTree(QIODevice*);
 
+    // Attribute names are interned into small integer keys, so that finding an
+    // attribute is an integer comparison rather than a string comparison.
+    // New names are only registered while elements are being created;
+    // finding the key for a name never registers it.
+    typedef int AttributeKey;
+    static AttributeKey attributeKey(const QString &name);
+    static AttributeKey findAttributeKey(const QString &name);
+
+    // Keys for the attributes which the writers read for almost every element.
+    static const AttributeKey KEY_TOPIC_ID;
+    static const AttributeKey KEY_CATEGORY_ID;
+    static const AttributeKey KEY_PREFIX;
+    static const AttributeKey KEY_SUFFIX;
+    static const AttributeKey KEY_PUBLIC_NAME;
+    static const AttributeKey KEY_TYPE;
+    static const AttributeKey KEY_STYLE;
+
+    // The values of "*_id" attributes in the RW file are interned into dense integers,
+    // so that tables indexed by ID can be simple arrays (see SymbolTable).
+    typedef int SymbolId;
+    static SymbolId symbolId(const QString &id);
+    static SymbolId findSymbol(const QString &id);
+    static int symbolCount();
+    static void clearSymbols();
+
     // objectName == XML element title
     struct Attribute {
         const QString name;
         const QString value;
+        const AttributeKey key{-1};
+        // Numeric attributes (pin x/y, span start/length) are only parsed once.
+        int int_value{0};
+        bool is_int{false};
+        SymbolId symbol{-1};
         Attribute() {}
-        Attribute(const char *name, const char *value) : name(name), value(value) {}
-        Attribute(const QStringRef &name, const QStringRef &value) : name(name.toString()), value(value.toString()) {}
+        Attribute(const char *name, const char *value) : name(name), value(value), key(attributeKey(this->name)) { parse_int(); }
+        Attribute(const QStringRef &name, const QStringRef &value) : name(name.toString()), value(value.toString()), key(attributeKey(this->name)) { parse_int(); parse_symbol(); }
+        Attribute(const QString &name, const QString &value) : name(name), value(value), key(attributeKey(this->name)) { parse_int(); }
+    private:
+        void parse_int();
+        void parse_symbol();
     };
 
     static void setTranslateHtml(bool flag) { translate_html = flag; }
 
-    bool hasAttribute(const QString &name) const;
-    const QString &attribute(const QString &name) const;
+    bool hasAttribute(const QString &name) const { return findAttribute(findAttributeKey(name)) != nullptr; }
+    bool hasAttribute(AttributeKey key) const { return findAttribute(key) != nullptr; }
+    const QString &attribute(const QString &name) const { return attribute(findAttributeKey(name)); }
+    const QString &attribute(AttributeKey key) const;
+    int intAttribute(const QString &name, int default_value = 0) const { return intAttribute(findAttributeKey(name), default_value); }
+    int intAttribute(AttributeKey key, int default_value = 0) const;
+    SymbolId symbolAttribute(const QString &name) const { return symbolAttribute(findAttributeKey(name)); }
+    SymbolId symbolAttribute(AttributeKey key) const;
     inline bool isFixedString() const { return is_fixed_text; }
-    inline const QString fixedText() const { return p_byte_data; }
+    // Text is stored once as UTF-8; fixedText() decodes it, byteData() is the raw UTF-8.
+    inline const QString fixedText() const { return QString::fromUtf8(p_byte_data); }
     inline const QByteArray &byteData() const { return p_byte_data; }
+    // Bytes of data held by this element itself (not its children), as an estimate of its output size.
+    inline int dataSize() const { return p_byte_data.size() + p_html_source.size(); }
     inline const QVector<Attribute> &attributes() const { return p_attributes; }
 
-    inline QList<XmlElement *> xmlChildren(const QString &name = QString()) const { return findChildren<XmlElement*>(name, Qt::FindDirectChildrenOnly); }
-    inline XmlElement *xmlChild(const QString &name = QString()) const { return findChild<XmlElement*>(name, Qt::FindDirectChildrenOnly); }
+    // Embedded HTML is only converted into child elements when the children are first requested.
+    // That conversion changes the tree, so it must only happen on the thread which owns the tree:
+    // call translateAll() before reading the tree from other threads.
+    inline QList<XmlElement *> xmlChildren(const QString &name = QString()) const { translate(); return findChildren<XmlElement*>(name, Qt::FindDirectChildrenOnly); }
+    inline XmlElement *xmlChild(const QString &name = QString()) const { translate(); return findChild<XmlElement*>(name, Qt::FindDirectChildrenOnly); }
+    void releaseTranslations();
+    void translateAll() const;
 
     void dump_tree() const;
     QString snippetName() const;
     QString childString() const;
+    const QByteArray &childBytes() const;
     XmlElement *parent() const { return qobject_cast<XmlElement*>(QObject::parent()); }
 
 private:
     XmlElement(QXmlStreamReader*, QObject *parent = nullptr);
     XmlElement(const QByteArray &fixed_text, QObject *parent);
     XmlElement(const GumboNode *info, QObject *parent);
+    XmlElement(const QString &tag, const QVector<Attribute> &attributes, QObject *parent);
     void parse_gumbo_nodes(const GumboNode *node);
+    bool parse_simple_html(const QByteArray &source);
+    inline void translate() const { if (p_html_pending) const_cast<XmlElement*>(this)->translate_html_source(); }
+    void translate_html_source();
+    const Attribute *findAttribute(AttributeKey key) const;
     // Real data is...
     QByteArray p_byte_data;
     QVector<Attribute> p_attributes;
+    QByteArray p_html_source;       // untranslated HTML (only when translate_html is set)
+    bool p_html_pending{false};
+    int p_first_translated{0};      // index of the first child created from p_html_source
     const bool is_fixed_text{false};
     static bool translate_html;
 };